@@ -31,7 +31,12 @@ set(build_shared_libs "${BUILD_SHARED_LIBS}")
 # ----------------------------------------------
 
 find_package(USD REQUIRED)
-find_package(Arnold REQUIRED)
+# The export benchmark builds against a mock of the Arnold API.
+if (BUILD_USD_PLUGIN OR BUILD_USD_MAYA_PLUGIN OR BUILD_USD_KATANA_PLUGIN)
+    find_package(Arnold REQUIRED)
+else ()
+    find_package(Arnold)
+endif ()
 
 # Core USD Package Requirements 
 # ----------------------------------------------
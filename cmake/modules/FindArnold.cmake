@@ -164,7 +164,7 @@ message(STATUS "Arnold version: ${ARNOLD_VERSION}")
 
 include(FindPackageHandleStandardArgs)
 
-if (${ARNOLD_VERSION_ARCH_NUM} VERSION_GREATER "4")
+if (ARNOLD_VERSION_ARCH_NUM VERSION_GREATER "4")
     find_package_handle_standard_args(Arnold
                                       REQUIRED_VARS
                                       ARNOLD_LIBRARY
@@ -1,13 +1,26 @@
 #include "arnoldHelpers.h"
+#include "stageCache.h"
 
+#include <pxr/base/tf/notice.h>
+#include <pxr/base/tf/weakBase.h>
+#include <pxr/usd/usd/notice.h>
 #include <pxr/usd/usdAi/aiShapeAPI.h>
+#include <pxr/usd/usdAi/tokens.h>
+
+#include <boost/functional/hash.hpp>
+
+#include <tbb/spin_rw_mutex.h>
+
+#include <functional>
+#include <memory>
+#include <unordered_map>
 
 PXR_NAMESPACE_OPEN_SCOPE
 
 namespace {
     template <typename T>
     struct _attributeDefinition {
-        decltype(&UsdAiShapeAPI::GetAiVisibleToCameraAttr) queryFn;
+        TfToken attrName;
         const char* paramName;
         T defaultValue;
     };
@@ -32,25 +45,257 @@ namespace {
         return FnKat::StringAttribute(v.GetString());
     }
 
+    // Sets the statement for the value of an authored attribute, returns
+    // false if nothing was set.
+    using _statementHandler = std::function<bool(const VtValue&, FnKat::GroupBuilder&)>;
+    using _statementMap = std::unordered_map<TfToken, _statementHandler, TfToken::HashFunctor>;
+
     template <typename T>
-    bool _handleAttributes(const std::vector<_attributeDefinition<T>>& attributes,
-                          const UsdAiShapeAPI& shapeAPI,
-                          FnKat::GroupBuilder& builder) {
-        auto attributeSet = false;
+    void _addStatements(const std::vector<_attributeDefinition<T>>& attributes,
+                        _statementMap& statements) {
         for (const auto& each : attributes) {
-            const auto attr = ((shapeAPI).*(each.queryFn))();
-            if (!attr.IsValid()) { continue; }
-            T v = each.defaultValue;
-            // TODO: Check if we need to filter the defaultValues.
-            // I think because of how Katana behaves we have to set these up,
-            // even if they are the default value, because the USD API handles
-            // the concept of an attribute not being set. Which doesn't work in Arnold.
-            if (attr.Get(&v) && v != each.defaultValue) {
-                builder.set(each.paramName, _createAttribute(v));
-                attributeSet = true;
+            const auto paramName = each.paramName;
+            const auto defaultValue = each.defaultValue;
+            statements.emplace(each.attrName,
+                [paramName, defaultValue] (const VtValue& value, FnKat::GroupBuilder& builder) -> bool {
+                    // TODO: Check if we need to filter the defaultValues.
+                    // I think because of how Katana behaves we have to set these up,
+                    // even if they are the default value, because the USD API handles
+                    // the concept of an attribute not being set. Which doesn't work in Arnold.
+                    if (value.IsHolding<T>() && value.UncheckedGet<T>() != defaultValue) {
+                        builder.set(paramName, _createAttribute(value.UncheckedGet<T>()));
+                        return true;
+                    }
+                    return false;
+                });
+        }
+    }
+
+    _statementMap _buildStatements() {
+        // Sadly std::array needs the size passed as a parameter, so a static const
+        // std::vector will do the same in our case.
+        const std::vector<_attributeDefinition<bool>> boolAttrs = {
+#ifdef ARNOLD5
+            {UsdAiTokens->aiVisibilityCamera, "visibility.AI_RAY_CAMERA", true},
+            {UsdAiTokens->aiVisibilityShadow, "visibility.AI_RAY_SHADOW", true},
+            {UsdAiTokens->aiVisibilityDiffuse_transmit, "visibility.AI_RAY_DIFFUSE_TRANSMIT", true},
+            {UsdAiTokens->aiVisibilitySpecular_transmit, "visibility.AI_RAY_SPECULAR_TRANSMIT", true},
+            {UsdAiTokens->aiVisibilityVolume, "visibility.AI_RAY_VOLUME", true},
+            {UsdAiTokens->aiVisibilityDiffuse_reflect, "visibility.AI_RAY_DIFFUSE_REFLECT", true},
+            {UsdAiTokens->aiVisibilitySpecular_reflect, "visibility.AI_RAY_SPECULAR_REFLECT", true},
+            {UsdAiTokens->aiVisibilitySubsurface, "visibility.AI_RAY_SUBSURFACE", true},
+            {UsdAiTokens->aiSidednessCamera, "sidedness.AI_RAY_CAMERA", true},
+            {UsdAiTokens->aiSidednessShadow, "sidedness.AI_RAY_SHADOW", true},
+            {UsdAiTokens->aiSidednessDiffuse_transmit, "sidedness.AI_RAY_DIFFUSE_TRANSMIT", true},
+            {UsdAiTokens->aiSidednessSpecular_transmit, "sidedness.AI_RAY_SPECULAR_TRANSMIT", true},
+            {UsdAiTokens->aiSidednessVolume, "sidedness.AI_RAY_VOLUME", true},
+            {UsdAiTokens->aiSidednessDiffuse_reflect, "sidedness.AI_RAY_DIFFUSE_REFLECT", true},
+            {UsdAiTokens->aiSidednessSpecular_reflect, "sidedness.AI_RAY_SPECULAR_REFLECT", true},
+            {UsdAiTokens->aiSidednessSubsurface, "sidedness.AI_RAY_SUBSURFACE", true},
+            {UsdAiTokens->aiAutobump_visibilityCamera, "autobump_visibility.AI_RAY_CAMERA", true},
+            {UsdAiTokens->aiAutobump_visibilityShadow, "autobump_visibility.AI_RAY_SHADOW", true},
+            {UsdAiTokens->aiAutobump_visibilityDiffuse_transmit, "autobump_visibility.AI_RAY_DIFFUSE_TRANSMIT", true},
+            {UsdAiTokens->aiAutobump_visibilitySpecular_transmit, "autobump_visibility.AI_RAY_SPECULAR_TRANSMIT", true},
+            {UsdAiTokens->aiAutobump_visibilityVolume, "autobump_visibility.AI_RAY_VOLUME", true},
+            {UsdAiTokens->aiAutobump_visibilityDiffuse_reflect, "autobump_visibility.AI_RAY_DIFFUSE_REFLECT", true},
+            {UsdAiTokens->aiAutobump_visibilitySpecular_reflect, "autobump_visibility.AI_RAY_SPECULAR_REFLECT", true},
+            {UsdAiTokens->aiAutobump_visibilitySubsurface, "autobump_visibility.AI_RAY_SUBSURFACE", true},
+#else
+            {UsdAiTokens->aiVisibilityCamera, "visibility.AI_RAY_CAMERA", true},
+            {UsdAiTokens->aiVisibilityShadow, "visibility.AI_RAY_SHADOW", true},
+            {UsdAiTokens->aiVisibilityReflected, "visibility.AI_RAY_REFLECTED", true},
+            {UsdAiTokens->aiVisibilityRefracted, "visibility.AI_RAY_REFRACTED", true},
+            {UsdAiTokens->aiVisibilitySubsurface, "visibility.AI_RAY_SUBSURFACE", true},
+            {UsdAiTokens->aiVisibilityDiffuse, "visibility.AI_RAY_DIFFUSE", true},
+            {UsdAiTokens->aiVisibilityGlossy, "visibility.AI_RAY_GLOSSY", true},
+            {UsdAiTokens->aiSidednessCamera, "sidedness.AI_RAY_CAMERA", true},
+            {UsdAiTokens->aiSidednessShadow, "sidedness.AI_RAY_SHADOW", true},
+            {UsdAiTokens->aiSidednessReflected, "sidedness.AI_RAY_REFLECTED", true},
+            {UsdAiTokens->aiSidednessRefracted, "sidedness.AI_RAY_REFRACTED", true},
+            {UsdAiTokens->aiSidednessSubsurface, "sidedness.AI_RAY_SUBSURFACE", true},
+            {UsdAiTokens->aiSidednessDiffuse, "sidedness.AI_RAY_DIFFUSE", true},
+            {UsdAiTokens->aiSidednessGlossy, "sidedness.AI_RAY_GLOSSY", true},
+            {UsdAiTokens->aiAutobump_visibilityCamera, "autobump_visibility.AI_RAY_CAMERA", true},
+            {UsdAiTokens->aiAutobump_visibilityShadow, "autobump_visibility.AI_RAY_SHADOW", true},
+            {UsdAiTokens->aiAutobump_visibilityReflected, "autobump_visibility.AI_RAY_REFLECTED", true},
+            {UsdAiTokens->aiAutobump_visibilityRefracted, "autobump_visibility.AI_RAY_REFRACTED", true},
+            {UsdAiTokens->aiAutobump_visibilitySubsurface, "autobump_visibility.AI_RAY_SUBSURFACE", true},
+            {UsdAiTokens->aiAutobump_visibilityDiffuse, "autobump_visibility.AI_RAY_DIFFUSE", true},
+            {UsdAiTokens->aiAutobump_visibilityGlossy, "autobump_visibility.AI_RAY_GLOSSY", true},
+#endif
+            // Non visibility attributes where the pattern still applies.
+            {UsdAiTokens->aiOpaque, "opaque", true},
+            {UsdAiTokens->aiReceive_shadows, "receive_shadows", true},
+            {UsdAiTokens->aiSelf_shadows, "self_shadows", true},
+            // Parameters with false as their default value.
+            {UsdAiTokens->aiMatte, "matte", false},
+            {UsdAiTokens->aiSmoothing, "smoothing", false},
+            {UsdAiTokens->aiSubdiv_smooth_derivs, "subdiv_smooth_derivs", false},
+            {UsdAiTokens->aiDisp_autobump, "disp_autobump", false},
+        };
+
+        const std::vector<_attributeDefinition<float>> floatAttrs {
+            {UsdAiTokens->aiSubdiv_adaptive_error, "subdiv_adaptive_error", 0.0f},
+            {UsdAiTokens->aiDisp_padding, "disp_padding", 0.0f},
+            {UsdAiTokens->aiDisp_height, "disp_height", 1.0f},
+            {UsdAiTokens->aiDisp_zero_value, "disp_zero_value", 0.0f},
+            {UsdAiTokens->aiRay_bias, "ray_bias", 0.000001f},
+        };
+
+        const std::vector<_attributeDefinition<unsigned int>> uintAttrs {
+            {UsdAiTokens->aiSubdiv_iterations, "iterations", 1},
+        };
+
+        const std::vector<_attributeDefinition<TfToken>> stringAttrs {
+            {UsdAiTokens->aiSubdiv_type, "subdiv_type", TfToken("none")},
+            {UsdAiTokens->aiSubdiv_adaptive_metric, "subdiv_adaptive_metric", TfToken("auto_")},
+            {UsdAiTokens->aiSubdiv_adaptive_space, "subdiv_adaptive_space", TfToken("raster")},
+            {UsdAiTokens->aiSubdiv_uv_smoothing, "subdiv_uv_smoothing", TfToken("pin_corners")},
+#ifdef ARNOLD5
+            {UsdAiTokens->aiTransform_type, "transform_type", TfToken("rotate_about_center")},
+#endif
+        };
+
+        _statementMap statements;
+        _addStatements(boolAttrs, statements);
+        _addStatements(floatAttrs, statements);
+        _addStatements(uintAttrs, statements);
+        _addStatements(stringAttrs, statements);
+        return statements;
+    }
+
+    // The resolved ai opinions of a prim, sorted by name like the authored
+    // properties they are read from.
+    using _opinions = std::vector<std::pair<const _statementMap::value_type*, VtValue>>;
+
+    size_t _hashOpinions(const _opinions& opinions) {
+        size_t hash = 0;
+        for (const auto& each : opinions) {
+            boost::hash_combine(hash, each.first);
+            boost::hash_combine(hash, each.second.GetHash());
+        }
+        return hash;
+    }
+
+    // Prims with the same opinions share the same statements attribute,
+    // similar prims of large environments mostly have one of a few sets.
+    // Entries are compared by value, the hash only picks the bucket.
+    struct _cachedStatements {
+        _opinions opinions;
+        FnKat::Attribute statements;
+    };
+
+    // Statements read from a stage. Instance proxies are cached by their
+    // prim in the master, so the attributes of a master are only read for
+    // its first instance. Both maps are cleared when they reach _maxEntries.
+    class _StageStatements : public TfWeakBase {
+    public:
+        explicit _StageStatements(const UsdStageWeakPtr& stage) {
+            _objectsChangedKey = TfNotice::Register(TfCreateWeakPtr(this), &_StageStatements::_OnObjectsChanged,
+                                                    stage);
+        }
+
+        ~_StageStatements() {
+            TfNotice::Revoke(_objectsChangedKey);
+        }
+
+        // Also returns the change counter to pass to InsertMaster.
+        bool FindMaster(const SdfPath& master, FnKat::Attribute& statements, size_t& generation) {
+            tbb::spin_rw_mutex::scoped_lock lock(_mutex, false);
+            generation = _generation;
+            const auto it = _masters.find(master);
+            if (it == _masters.end()) { return false; }
+            statements = it->second;
+            return true;
+        }
+
+        // Nothing is stored if the stage changed since FindMaster, the
+        // statements might have been read from the old values.
+        void InsertMaster(const SdfPath& master, const FnKat::Attribute& statements, size_t generation) {
+            tbb::spin_rw_mutex::scoped_lock lock(_mutex, true);
+            if (generation != _generation) { return; }
+            if (_masters.size() >= _maxEntries) { _masters.clear(); }
+            _masters.emplace(master, statements);
+        }
+
+        bool FindShared(size_t hash, const _opinions& opinions, FnKat::Attribute& statements) {
+            tbb::spin_rw_mutex::scoped_lock lock(_mutex, false);
+            const auto range = _shared.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second.opinions == opinions) {
+                    statements = it->second.statements;
+                    return true;
+                }
             }
+            return false;
         }
-        return attributeSet;
+
+        void InsertShared(size_t hash, _opinions&& opinions, const FnKat::Attribute& statements) {
+            tbb::spin_rw_mutex::scoped_lock lock(_mutex, true);
+            if (_shared.size() >= _maxEntries) { _shared.clear(); }
+            _shared.emplace(hash, _cachedStatements {std::move(opinions), statements});
+        }
+
+    private:
+        static constexpr size_t _maxEntries = 1 << 16;
+
+        // Edits to the prims a master is built from are reported on those
+        // prims, not on the master, so any change drops every master. Shared
+        // entries are keyed by value and stay valid.
+        void _OnObjectsChanged(const UsdNotice::ObjectsChanged& notice, const UsdStageWeakPtr& sender) {
+            if (notice.GetResyncedPaths().empty() && notice.GetChangedInfoOnlyPaths().empty()) { return; }
+            tbb::spin_rw_mutex::scoped_lock lock(_mutex, true);
+            ++_generation;
+            _masters.clear();
+        }
+
+        TfNotice::Key _objectsChangedKey;
+        tbb::spin_rw_mutex _mutex;
+        size_t _generation = 0;
+        std::unordered_map<SdfPath, FnKat::Attribute, SdfPath::Hash> _masters;
+        std::unordered_multimap<size_t, _cachedStatements> _shared;
+    };
+
+    PerStageCache<_StageStatements> _stageStatements;
+
+    FnKat::Attribute _readStatements(const UsdPrim& prim, _StageStatements& cache) {
+        // Only the authored attributes in the ai namespace are visited, instead
+        // of looking up each statement, most prims have none of them.
+        static const std::string aiNamespace("ai");
+        const auto properties = prim.GetAuthoredPropertiesInNamespace(aiNamespace);
+        if (properties.empty()) { return FnKat::Attribute(); }
+
+        static const auto statements = _buildStatements();
+        _opinions opinions;
+        for (const auto& property : properties) {
+            const auto it = statements.find(property.GetName());
+            if (it == statements.end()) { continue; }
+            const auto attr = property.As<UsdAttribute>();
+            VtValue value;
+            if (!attr.IsValid() || !attr.Get(&value)) { continue; }
+            opinions.emplace_back(&*it, std::move(value));
+        }
+        if (opinions.empty()) { return FnKat::Attribute(); }
+
+        const auto hash = _hashOpinions(opinions);
+        FnKat::Attribute result;
+        if (cache.FindShared(hash, opinions, result)) { return result; }
+
+        FnKat::GroupBuilder builder;
+        auto needToBuild = false;
+        for (const auto& each : opinions) {
+            needToBuild |= each.first->second(each.second, builder);
+        }
+
+        // SubdivAdaptiveMetricAttr will require special handling,
+        // if we decide to setup parameters even with the
+        // default values. It requires special handling, because one of the values
+        // is named auto. The way USD generates tokens, it collides with the c++ auto
+        // keyword, so we had to name it auto_.
+
+        if (needToBuild) { result = builder.build(); }
+        cache.InsertShared(hash, std::move(opinions), result);
+        return result;
     }
 }
 
@@ -108,107 +353,21 @@ GetArnoldAttrTypeHint(const SdfValueTypeName& scalarType)
 
 FnKat::Attribute
 GetArnoldStatementsGroup(const UsdPrim& prim) {
-    FnKat::GroupBuilder builder;
-
     UsdAiShapeAPI shapeAPI(prim);
     if (!shapeAPI) { return FnKat::Attribute(); }
 
-    // Sadly std::array needs the size passed as a parameter, so a static const
-    // std::vector will do the same in our case.
-    static const std::vector<_attributeDefinition<bool>> boolAttrs = {
-#ifdef ARNOLD5
-        {&UsdAiShapeAPI::GetAiVisibleToCameraAttr, "visibility.AI_RAY_CAMERA", true},
-        {&UsdAiShapeAPI::GetAiVisibleToShadowAttr, "visibility.AI_RAY_SHADOW", true},
-        {&UsdAiShapeAPI::GetAiVisibleToDiffuseTransmitAttr, "visibility.AI_RAY_DIFFUSE_TRANSMIT", true},
-        {&UsdAiShapeAPI::GetAiVisibleToSpecularTransmitAttr, "visibility.AI_RAY_SPECULAR_TRANSMIT", true},
-        {&UsdAiShapeAPI::GetAiVisibleToVolumeAttr, "visibility.AI_RAY_VOLUME", true},
-        {&UsdAiShapeAPI::GetAiVisibleToDiffuseReflectAttr, "visibility.AI_RAY_DIFFUSE_REFLECT", true},
-        {&UsdAiShapeAPI::GetAiVisibleToSpecularReflectAttr, "visibility.AI_RAY_SPECULAR_REFLECT", true},
-        {&UsdAiShapeAPI::GetAiVisibleToSubsurfaceAttr, "visibility.AI_RAY_SUBSURFACE", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToCameraAttr, "sidedness.AI_RAY_CAMERA", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToShadowAttr, "sidedness.AI_RAY_SHADOW", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToDiffuseTransmitAttr, "sidedness.AI_RAY_DIFFUSE_TRANSMIT", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToSpecularTransmitAttr, "sidedness.AI_RAY_SPECULAR_TRANSMIT", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToVolumeAttr, "sidedness.AI_RAY_VOLUME", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToDiffuseReflectAttr, "sidedness.AI_RAY_DIFFUSE_REFLECT", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToSpecularReflectAttr, "sidedness.AI_RAY_SPECULAR_REFLECT", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToSubsurfaceAttr, "sidedness.AI_RAY_SUBSURFACE", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToCameraAttr, "autobump_visibility.AI_RAY_CAMERA", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToShadowAttr, "autobump_visibility.AI_RAY_SHADOW", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToDiffuseTransmitAttr, "autobump_visibility.AI_RAY_DIFFUSE_TRANSMIT", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToSpecularTransmitAttr, "autobump_visibility.AI_RAY_SPECULAR_TRANSMIT", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToVolumeAttr, "autobump_visibility.AI_RAY_VOLUME", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToDiffuseReflectAttr, "autobump_visibility.AI_RAY_DIFFUSE_REFLECT", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToSpecularReflectAttr, "autobump_visibility.AI_RAY_SPECULAR_REFLECT", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToSubsurfaceAttr, "autobump_visibility.AI_RAY_SUBSURFACE", true},
-#else
-        {&UsdAiShapeAPI::GetAiVisibleToCameraAttr, "visibility.AI_RAY_CAMERA", true},
-        {&UsdAiShapeAPI::GetAiVisibleToShadowAttr, "visibility.AI_RAY_SHADOW", true},
-        {&UsdAiShapeAPI::GetAiVisibleToReflectionAttr, "visibility.AI_RAY_REFLECTED", true},
-        {&UsdAiShapeAPI::GetAiVisibleToRefractionAttr, "visibility.AI_RAY_REFRACTED", true},
-        {&UsdAiShapeAPI::GetAiVisibleToSubsurfaceAttr, "visibility.AI_RAY_SUBSURFACE", true},
-        {&UsdAiShapeAPI::GetAiVisibleToDiffuseAttr, "visibility.AI_RAY_DIFFUSE", true},
-        {&UsdAiShapeAPI::GetAiVisibleToGlossyAttr, "visibility.AI_RAY_GLOSSY", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToCameraAttr, "sidedness.AI_RAY_CAMERA", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToShadowAttr, "sidedness.AI_RAY_SHADOW", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToReflectionAttr, "sidedness.AI_RAY_REFLECTED", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToRefractionAttr, "sidedness.AI_RAY_REFRACTED", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToSubsurfaceAttr, "sidedness.AI_RAY_SUBSURFACE", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToDiffuseAttr, "sidedness.AI_RAY_DIFFUSE", true},
-        {&UsdAiShapeAPI::GetAiDoubleSidedToGlossyAttr, "sidedness.AI_RAY_GLOSSY", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToCameraAttr, "autobump_visibility.AI_RAY_CAMERA", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToShadowAttr, "autobump_visibility.AI_RAY_SHADOW", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToReflectionAttr, "autobump_visibility.AI_RAY_REFLECTED", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToRefractionAttr, "autobump_visibility.AI_RAY_REFRACTED", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToSubsurfaceAttr, "autobump_visibility.AI_RAY_SUBSURFACE", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToDiffuseAttr, "autobump_visibility.AI_RAY_DIFFUSE", true},
-        {&UsdAiShapeAPI::GetAiAutobumpVisibleToGlossyAttr, "autobump_visibility.AI_RAY_GLOSSY", true},
-#endif
-        // Non visibility attributes where the pattern still applies.
-        {&UsdAiShapeAPI::GetAiOpaqueAttr, "opaque", true},
-        {&UsdAiShapeAPI::GetAiReceiveShadowsAttr, "receive_shadows", true},
-        {&UsdAiShapeAPI::GetAiSelfShadowsAttr, "self_shadows", true},
-        // Parameters with false as their default value.
-        {&UsdAiShapeAPI::GetAiMatteAttr, "matte", false},
-        {&UsdAiShapeAPI::GetAiSmoothingAttr, "smoothing", false},
-        {&UsdAiShapeAPI::GetAiSubdivSmoothDerivsAttr, "subdiv_smooth_derivs", false},
-        {&UsdAiShapeAPI::GetAiDispAutobumpAttr, "disp_autobump", false},
-    };
-
-    static const std::vector<_attributeDefinition<float>> floatAttrs {
-        {&UsdAiShapeAPI::GetAiSubdivAdaptiveErrorAttr, "subdiv_adaptive_error", 0.0f},
-        {&UsdAiShapeAPI::GetAiDispPaddingAttr, "disp_padding", 0.0f},
-        {&UsdAiShapeAPI::GetAiDispHeightAttr, "disp_height", 1.0f},
-        {&UsdAiShapeAPI::GetAiDispZeroValueAttr, "disp_zero_value", 0.0f},
-        {&UsdAiShapeAPI::GetAiRayBiasAttr, "ray_bias", 0.000001f},
-    };
-
-    static const std::vector<_attributeDefinition<unsigned int>> uintAttrs {
-        {&UsdAiShapeAPI::GetAiSubdivIterationsAttr, "iterations", 1},
-    };
-
-    static const std::vector<_attributeDefinition<TfToken>> stringAttrs {
-        {&UsdAiShapeAPI::GetAiSubdivTypeAttr, "subdiv_type", TfToken("none")},
-        {&UsdAiShapeAPI::GetAiSubdivAdaptiveMetricAttr, "subdiv_adaptive_metric", TfToken("auto_")},
-        {&UsdAiShapeAPI::GetAiSubdivAdaptiveSpaceAttr, "subdiv_adaptive_space", TfToken("raster")},
-        {&UsdAiShapeAPI::GetAiSubdivUVSmoothingAttr, "subdiv_uv_smoothing", TfToken("pin_corners")},
-#ifdef ARNOLD5
-        {&UsdAiShapeAPI::GetAiTransformTypeAttr, "transform_type", TfToken("rotate_about_center")},
-#endif
-    };
-
-    auto needToBuild = _handleAttributes(boolAttrs, shapeAPI, builder);
-    needToBuild |= _handleAttributes(floatAttrs, shapeAPI, builder);
-    needToBuild |= _handleAttributes(uintAttrs, shapeAPI, builder);
-    needToBuild |= _handleAttributes(stringAttrs, shapeAPI, builder);
-
-    // SubdivAdaptiveMetricAttr will require special handling,
-    // if we decide to setup parameters even with the
-    // default values. It requires special handling, because one of the values
-    // is named auto. The way USD generates tokens, it collides with the c++ auto
-    // keyword, so we had to name it auto_.
+    const auto cache = _stageStatements.Get(prim.GetStage(), [] (const UsdStageWeakPtr& stage) {
+        return std::make_shared<_StageStatements>(stage);
+    });
+    if (!prim.IsInstanceProxy()) { return _readStatements(prim, *cache); }
 
-    return needToBuild ? builder.build() : FnKat::Attribute();
+    const auto master = prim.GetPrimInMaster();
+    FnKat::Attribute result;
+    size_t generation = 0;
+    if (cache->FindMaster(master.GetPath(), result, generation)) { return result; }
+    result = _readStatements(master, *cache);
+    cache->InsertMaster(master.GetPath(), result, generation);
+    return result;
 }
 
 PXR_NAMESPACE_CLOSE_SCOPE
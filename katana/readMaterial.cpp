@@ -0,0 +1,315 @@
+#include "readMaterial.h"
+#include "stageCache.h"
+
+#include <usdKatana/utils.h>
+
+#include <pxr/base/gf/matrix4d.h>
+#include <pxr/base/gf/vec2f.h>
+#include <pxr/base/gf/vec3f.h>
+#include <pxr/base/gf/vec4f.h>
+#include <pxr/base/tf/notice.h>
+#include <pxr/base/tf/weakBase.h>
+#include <pxr/usd/usd/attribute.h>
+#include <pxr/usd/usd/notice.h>
+#include <pxr/usd/usd/primRange.h>
+#include <pxr/usd/usd/relationship.h>
+#include <pxr/usd/usd/stage.h>
+#include <pxr/usd/usdAi/aiMaterialAPI.h>
+#include <pxr/usd/usdShade/material.h>
+#include <pxr/usd/usdShade/shader.h>
+#include <pxr/usd/usdShade/tokens.h>
+
+#include <FnAttribute/FnGroupBuilder.h>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/spin_rw_mutex.h>
+
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+namespace {
+    struct _IndexEntry {
+        // Invalid when the material has no Arnold network.
+        FnKat::GroupAttribute material;
+        // Every prim read for the material, changing any of them drops the entry.
+        std::vector<SdfPath> dependencies;
+        // Networks with animated inputs are only reused at the same time.
+        bool timeVarying = false;
+        double time = 0.0;
+    };
+
+    // Component and array element inputs are named param:r and param:i2,
+    // Katana expects param.r and param:2.
+    void _addConnection(FnKat::GroupBuilder& builder, const std::string& inputName,
+                        const SdfPath& target, const std::string& sourceHandle) {
+        static const std::string outputs(UsdShadeTokens->outputs.GetString());
+        auto paramName = inputName;
+        const auto colonPos = paramName.find(':');
+        if (colonPos != paramName.npos) { // either array elem or component
+            const auto comp = paramName.substr(colonPos + 1);
+            // Just to make sure it's not a malformed variable, like one that ends with a :
+            if (comp.empty()) { return; }
+            paramName.resize(colonPos);
+            if (comp[0] == 'i') { // array connection
+                paramName += ":" + comp.substr(1);
+            } else {
+                paramName += "." + comp;
+            }
+        }
+
+        auto targetName = target.GetName();
+        if (targetName.compare(0, outputs.length(), outputs) != 0) { return; }
+        targetName = targetName.substr(outputs.length());
+        // Node parameters are connected through the node output.
+        if (targetName == "node") {
+            targetName = "out";
+        } else if (targetName != "out") { // component connection
+            targetName = "out." + targetName;
+        }
+        builder.set(paramName, FnKat::StringAttribute(targetName + "@" + sourceHandle));
+    }
+
+    template <typename T>
+    bool _takeFirstKey(VtValue& value, size_t keys) {
+        if (!value.IsHolding<VtArray<T>>()) { return false; }
+        const auto& arr = value.UncheckedGet<VtArray<T>>();
+        VtArray<T> first(arr.size() / keys);
+        std::copy(arr.begin(), arr.begin() + first.size(), first.begin());
+        value = VtValue(first);
+        return true;
+    }
+
+    // Arrays with motion keys store the keys one after the other, like
+    // AiShaderImport reads them. Only the first key is passed to Katana, so
+    // Arnold gets arrays of the right length.
+    void _dropMotionKeys(const UsdAttribute& attribute, VtValue& value) {
+        static const TfToken motionKeysKey("motionKeys");
+        if (!value.IsArrayValued()) { return; }
+        const auto motionKeys = attribute.GetCustomDataByKey(motionKeysKey);
+        if (!motionKeys.IsHolding<int>() || motionKeys.UncheckedGet<int>() < 2) { return; }
+        const auto keys = static_cast<size_t>(motionKeys.UncheckedGet<int>());
+        if (value.GetArraySize() % keys != 0) { return; }
+        _takeFirstKey<uint8_t>(value, keys) || _takeFirstKey<int32_t>(value, keys) ||
+            _takeFirstKey<uint32_t>(value, keys) || _takeFirstKey<bool>(value, keys) ||
+            _takeFirstKey<float>(value, keys) || _takeFirstKey<GfVec2f>(value, keys) ||
+            _takeFirstKey<GfVec3f>(value, keys) || _takeFirstKey<GfVec4f>(value, keys) ||
+            _takeFirstKey<std::string>(value, keys) || _takeFirstKey<GfMatrix4d>(value, keys);
+    }
+
+    // Converts the network in a single walk from the terminals. Connections
+    // are read from the inputs, inputs:param.connect targeting the outputs of
+    // the source shader. Older assets store them as connectedSourceFor:param
+    // relationships instead, those are still read but inputs take precedence.
+    _IndexEntry _ReadNetwork(const UsdPrim& material, double time) {
+        static const std::string connectedSourceFor("connectedSourceFor");
+        static const std::string inputs(UsdShadeTokens->inputs.GetString());
+        _IndexEntry entry;
+        entry.time = time;
+        entry.dependencies.push_back(material.GetPath());
+
+        const auto stage = material.GetStage();
+        std::vector<UsdPrim> pending;
+        // Returns the handle of the first shader targeted. Targets that don't
+        // resolve are dependencies too, so authoring them drops the entry,
+        // the others are added when visited.
+        auto addTargets = [&stage, &pending, &entry] (const SdfPathVector& targets) -> std::string {
+            std::string handle;
+            for (const auto& target : targets) {
+                const auto shader = stage->GetPrimAtPath(target.GetPrimPath());
+                if (!shader.IsValid()) {
+                    entry.dependencies.push_back(target.GetPrimPath());
+                    continue;
+                }
+                pending.push_back(shader);
+                if (handle.empty()) { handle = PxrUsdKatanaUtils::GenerateShadingNodeHandle(shader); }
+            }
+            return handle;
+        };
+
+        FnKat::GroupBuilder terminalsBuilder;
+        SdfPathVector targets;
+        UsdAiMaterialAPI aiMaterialAPI(material);
+        aiMaterialAPI.GetSurfaceRel().GetTargets(&targets);
+        const auto surface = addTargets(targets);
+        if (!surface.empty()) {
+            terminalsBuilder.set("arnoldSurface", FnKat::StringAttribute(surface));
+            terminalsBuilder.set("arnoldSurfacePort", FnKat::StringAttribute("out"));
+        }
+        aiMaterialAPI.GetDisplacementRel().GetTargets(&targets);
+        const auto displacement = addTargets(targets);
+        if (!displacement.empty()) {
+            terminalsBuilder.set("arnoldDisplacement", FnKat::StringAttribute(displacement));
+            terminalsBuilder.set("arnoldDisplacementPort", FnKat::StringAttribute("out"));
+        }
+        if (pending.empty()) { return entry; }
+
+        FnKat::GroupBuilder nodesBuilder;
+        std::unordered_set<SdfPath, SdfPath::Hash> visited;
+        while (!pending.empty()) {
+            const auto shader = pending.back();
+            pending.pop_back();
+            if (!visited.insert(shader.GetPath()).second) { continue; }
+            entry.dependencies.push_back(shader.GetPath());
+
+            TfToken id;
+            UsdShadeShader(shader).GetIdAttr().Get(&id);
+            if (id.IsEmpty()) { continue; }
+
+            const auto handle = PxrUsdKatanaUtils::GenerateShadingNodeHandle(shader);
+            FnKat::GroupBuilder parametersBuilder;
+            FnKat::GroupBuilder connectionsBuilder;
+            for (const auto& property : shader.GetAuthoredPropertiesInNamespace(connectedSourceFor)) {
+                const auto relationship = property.As<UsdRelationship>();
+                if (!relationship) { continue; }
+                relationship.GetTargets(&targets);
+                const auto sourceHandle = addTargets(targets);
+                if (targets.size() != 1 || sourceHandle.empty()) { continue; }
+                _addConnection(connectionsBuilder, property.GetName().GetString().substr(connectedSourceFor.length() + 1),
+                               targets.front(), sourceHandle);
+            }
+            for (const auto& property : shader.GetAuthoredPropertiesInNamespace(inputs)) {
+                const auto attribute = property.As<UsdAttribute>();
+                if (!attribute) { continue; }
+                const auto inputName = property.GetName().GetString().substr(inputs.length());
+                if (attribute.GetConnections(&targets) && !targets.empty()) {
+                    const auto sourceHandle = addTargets(targets);
+                    if (targets.size() == 1 && !sourceHandle.empty()) {
+                        _addConnection(connectionsBuilder, inputName, targets.front(), sourceHandle);
+                    }
+                    continue;
+                }
+                // Components and array elements are only authored for connections.
+                if (inputName.find(':') != inputName.npos) { continue; }
+                VtValue value;
+                if (!attribute.Get(&value, time) || value.IsEmpty()) { continue; }
+                entry.timeVarying |= attribute.ValueMightBeTimeVarying();
+                _dropMotionKeys(attribute, value);
+                parametersBuilder.set(inputName, PxrUsdKatanaUtils::ConvertVtValueToKatAttr(value, true));
+            }
+
+            FnKat::GroupBuilder nodeBuilder;
+            nodeBuilder.set("name", FnKat::StringAttribute(handle));
+            nodeBuilder.set("srcName", FnKat::StringAttribute(handle));
+            nodeBuilder.set("type", FnKat::StringAttribute(id.GetString()));
+            nodeBuilder.set("target", FnKat::StringAttribute("arnold"));
+            nodeBuilder.set("parameters", parametersBuilder.build());
+            nodeBuilder.set("connections", connectionsBuilder.build());
+            nodesBuilder.set(handle, nodeBuilder.build());
+        }
+
+        FnKat::GroupBuilder materialBuilder;
+        materialBuilder.set("style", FnKat::StringAttribute("network"));
+        materialBuilder.set("nodes", nodesBuilder.build());
+        materialBuilder.set("terminals", terminalsBuilder.build());
+        entry.material = materialBuilder.build();
+        return entry;
+    }
+
+    // Networks of the materials of a stage, built for all of them the first
+    // time one is read.
+    class _MaterialIndex : public TfWeakBase {
+    public:
+        _MaterialIndex(const UsdStageWeakPtr& stage, double time) : _stage(stage) {
+            _objectsChangedKey = TfNotice::Register(TfCreateWeakPtr(this), &_MaterialIndex::_OnObjectsChanged,
+                                                    _stage);
+            _Build(time);
+        }
+
+        ~_MaterialIndex() {
+            TfNotice::Revoke(_objectsChangedKey);
+        }
+
+        FnKat::GroupAttribute Get(const UsdPrim& material, double time) {
+            size_t generation = 0;
+            {
+                tbb::spin_rw_mutex::scoped_lock lock(_mutex, false);
+                const auto it = _entries.find(material.GetPath());
+                if (it != _entries.end() && (!it->second.timeVarying || it->second.time == time)) {
+                    return it->second.material;
+                }
+                generation = _generation;
+            }
+            // New, animated or changed since the index was built. The network
+            // is not stored if a change arrived while it was read, it might
+            // have been read from the old values and would never be dropped.
+            auto entry = _ReadNetwork(material, time);
+            auto network = entry.material;
+            tbb::spin_rw_mutex::scoped_lock lock(_mutex, true);
+            if (generation == _generation) {
+                _entries[material.GetPath()] = std::move(entry);
+            }
+            return network;
+        }
+
+    private:
+        void _Build(double time) {
+            const auto generation = _generation;
+            std::vector<UsdPrim> materials;
+            for (const auto& prim : _stage->Traverse()) {
+                if (prim.IsA<UsdShadeMaterial>()) { materials.push_back(prim); }
+            }
+            std::vector<_IndexEntry> entries(materials.size());
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, materials.size()),
+                [&] (const tbb::blocked_range<size_t>& range) {
+                    for (auto i = range.begin(); i != range.end(); ++i) {
+                        entries[i] = _ReadNetwork(materials[i], time);
+                    }
+                });
+            tbb::spin_rw_mutex::scoped_lock lock(_mutex, true);
+            if (generation != _generation) { return; }
+            for (size_t i = 0; i < materials.size(); ++i) {
+                _entries[materials[i].GetPath()] = std::move(entries[i]);
+            }
+        }
+
+        void _OnObjectsChanged(const UsdNotice::ObjectsChanged& notice, const UsdStageWeakPtr& sender) {
+            std::vector<SdfPath> changed;
+            for (const auto& path : notice.GetResyncedPaths()) { changed.push_back(path.GetPrimPath()); }
+            for (const auto& path : notice.GetChangedInfoOnlyPaths()) { changed.push_back(path.GetPrimPath()); }
+            if (changed.empty()) { return; }
+            auto isChanged = [&changed] (const SdfPath& path) -> bool {
+                for (const auto& each : changed) {
+                    if (path.HasPrefix(each)) { return true; }
+                }
+                return false;
+            };
+            tbb::spin_rw_mutex::scoped_lock lock(_mutex, true);
+            ++_generation;
+            for (auto it = _entries.begin(); it != _entries.end();) {
+                const auto& dependencies = it->second.dependencies;
+                if (std::any_of(dependencies.begin(), dependencies.end(), isChanged)) {
+                    it = _entries.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        UsdStageWeakPtr _stage;
+        TfNotice::Key _objectsChangedKey;
+        tbb::spin_rw_mutex _mutex;
+        // Counts the changes, guarded by _mutex.
+        size_t _generation = 0;
+        std::unordered_map<SdfPath, _IndexEntry, SdfPath::Hash> _entries;
+    };
+
+    PerStageCache<_MaterialIndex> _indices;
+}
+
+FnKat::GroupAttribute
+GetAiMaterialNetwork(const UsdPrim& material, double time)
+{
+    const auto stage = material.GetStage();
+    if (!stage) { return FnKat::GroupAttribute(); }
+    const auto index = _indices.Get(stage, [time] (const UsdStageWeakPtr& indexed) {
+        return std::make_shared<_MaterialIndex>(indexed, time);
+    });
+    return index->Get(material, time);
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
@@ -0,0 +1,22 @@
+#ifndef PXRUSDKATANA_READAIMATERIAL_H
+#define PXRUSDKATANA_READAIMATERIAL_H
+
+#include <pxr/usd/usd/prim.h>
+
+#include <FnAttribute/FnAttribute.h>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \brief returns the Arnold network of \p material at \p time, or an
+/// invalid attribute when it has none.
+///
+/// The networks of UsdAiMaterialAPI materials are converted directly to
+/// material.nodes and material.terminals, and cached per material for each
+/// stage. They are merged into the material usdKatana reads, so its other
+/// terminals, interface and base material are kept.
+FnKat::GroupAttribute
+GetAiMaterialNetwork(const UsdPrim& material, double time);
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXRUSDKATANA_READAIMATERIAL_H
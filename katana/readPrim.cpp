@@ -1,13 +1,12 @@
 #include "readPrim.h"
 
 #include <pxr/usd/usdAi/aiShapeAPI.h>
-#include <pxr/usd/usdAi/aiMaterialAPI.h>
 #include <pxr/usd/usdShade/material.h>
 
 #include <usdKatana/attrMap.h>
-#include <usdKatana/utils.h>
 
 #include "arnoldHelpers.h"
+#include "readMaterial.h"
 
 PXR_NAMESPACE_OPEN_SCOPE
 
@@ -43,94 +42,13 @@ void readPrimLocation(
     static const std::string statementsName("arnoldStatements");
     updateOrCreateAttr(statementsName, GetArnoldStatementsGroup(prim));
 
-    auto stage = prim.GetStage();
-    if (stage == nullptr) { return; }
-
-    auto mapRelations = [&stage] (const UsdRelationship& relationship
-        , std::function<void(const UsdPrim&)> fn) {
-        static __thread SdfPathVector targets; targets.clear();
-        relationship.GetTargets(&targets);
-        for (const auto& target: targets) {
-            const auto shader = stage->GetPrimAtPath(target);
-            if (shader.IsValid()) { fn(shader); }
-        }
-    };
-
-    // It's hard to decide the exact frequency of inserts
-    // and reads, but most likely it's the same magnitude.
-    // We could also try a vector here.
-    std::set<std::string> processedMaterials;
-
-    // We can't use auto here, otherwise the lambda won't be able to capture itself.
-    std::function<void(const UsdPrim&)> traverseShader
-        = [&](const UsdPrim& shader) {
-        // TODO: we can also use getInputs from the new API.
-        const auto shadingNodeHandle = PxrUsdKatanaUtils::GenerateShadingNodeHandle(shader);
-        if (processedMaterials.find(shadingNodeHandle) != processedMaterials.end()) {
-            return;
-        }
-        processedMaterials.insert(shadingNodeHandle);
-        static const std::string baseAttr("material.nodes.");
-        std::stringstream ss; ss << baseAttr << shadingNodeHandle;
-        if (!interface.getOutputAttr(ss.str()).isValid()) { return; }
-        const auto relationships = shader.GetRelationships();
-        FnKat::GroupBuilder builder;
-        for (const auto& relationship: relationships) {
-            static const std::string connectedSourceFor("connectedSourceFor:");
-            const auto relationshipName = relationship.GetName().GetString();
-            if (relationshipName.compare(0, connectedSourceFor.length(), connectedSourceFor) != 0) { continue; }
-
-            auto paramName = relationshipName.substr(connectedSourceFor.length());
-            auto colonPos = paramName.find(':');
-            if (colonPos != paramName.npos) { // either array elem or component
-                auto comp = paramName.substr(colonPos + 1);
-                paramName = paramName.substr(0, colonPos);
-                if (comp.length() == 0) { continue; } // Just to make sure it's not a malformed
-                // variable, like one that ends with a :
-                if (comp[0] == 'i') { // array connection
-                    paramName += ":" + comp.substr(1);
-                } else {
-                    paramName += "." + comp;
-                }
-            } else {
-                continue; // The existing code already handles this!
-            }
-
-            static __thread SdfPathVector targets;
-            targets.clear();
-            relationship.GetTargets(&targets);
-            if (targets.size() != 1) { continue; }
-
-            const auto& target = targets.front();
-            auto targetName = target.GetName();
-            static const std::string outputs("outputs:");
-            if (targetName.compare(0, outputs.length(), outputs) != 0) { continue; }
-            targetName = targetName.substr(outputs.length());
-            if (targetName != "out") { // component connection
-                targetName = "out." + targetName;
-            }
-            std::stringstream targetSS; targetSS << targetName << '@';
-            targetSS << target.GetParentPath().GetName();
-            builder.set(paramName, FnKat::StringAttribute(targetSS.str()));
-
-            // TODO: we might traverse things twice because of this.
-            // Also, infinite recursion, beware!
-            mapRelations(relationship, traverseShader);
-        }
-
-        FnKat::Attribute connections = builder.isValid() ? builder.build() : FnKat::Attribute();
-        ss << ".connections";
-        updateOrCreateAttr(ss.str(), connections);
-    };
-
-    // We are handling connections here, because usd-arnold stores the connections in it's own way.
-    // So we check for the materials connected to the node.
-    const UsdShadeMaterial material(prim);
-    if (material) {
-        UsdAiMaterialAPI aiMaterialAPI(prim);
-        mapRelations(aiMaterialAPI.GetSurfaceRel(), traverseShader);
-        mapRelations(aiMaterialAPI.GetDisplacementRel(), traverseShader);
-    }
+    // Materials are read by usdKatana's look op, which also stops the
+    // traversal below them, the Arnold nodes and terminals are added to
+    // what it read.
+    if (!prim.IsA<UsdShadeMaterial>()) { return; }
+    static const std::string materialName("material");
+    updateOrCreateAttr(materialName,
+                       GetAiMaterialNetwork(prim, privateData->GetUsdInArgs()->GetCurrentTime()));
 }
 
 PXR_NAMESPACE_CLOSE_SCOPE
@@ -0,0 +1,67 @@
+#ifndef PXRUSDKATANA_STAGECACHE_H
+#define PXRUSDKATANA_STAGECACHE_H
+
+#include <pxr/usd/usd/stage.h>
+
+#include <tbb/spin_rw_mutex.h>
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+/// \brief objects built once per stage and shared by all the threads
+/// cooking it.
+///
+/// Lookups only take a read lock. Objects of closed stages are released
+/// when the next stage is added, never on the lookup path.
+template <typename T>
+class PerStageCache {
+public:
+    /// \brief returns the object of \p stage, calling \p create with the
+    /// stage if there is none yet. Objects are created one at a time, so
+    /// threads asking for the same new stage build it once.
+    template <typename F>
+    std::shared_ptr<T> Get(const UsdStageWeakPtr& stage, F&& create) {
+        const auto* key = get_pointer(stage);
+        if (const auto found = _Find(key)) { return found; }
+
+        std::lock_guard<std::mutex> createLock(_createMutex);
+        if (const auto found = _Find(key)) { return found; }
+        std::shared_ptr<T> value(create(stage));
+        tbb::spin_rw_mutex::scoped_lock lock(_mutex, true);
+        for (auto it = _entries.begin(); it != _entries.end();) {
+            if (it->second.stage.IsExpired()) {
+                it = _entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        _entries[key] = _Entry {stage, value};
+        return value;
+    }
+
+private:
+    // A new stage can be allocated at the address of a closed one, so
+    // entries are matched on the weak pointer too.
+    std::shared_ptr<T> _Find(const UsdStage* key) {
+        tbb::spin_rw_mutex::scoped_lock lock(_mutex, false);
+        const auto it = _entries.find(key);
+        if (it == _entries.end() || it->second.stage.IsExpired()) { return nullptr; }
+        return it->second.value;
+    }
+
+    struct _Entry {
+        UsdStageWeakPtr stage;
+        std::shared_ptr<T> value;
+    };
+
+    tbb::spin_rw_mutex _mutex;
+    std::mutex _createMutex;
+    std::unordered_map<const UsdStage*, _Entry> _entries;
+};
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif // PXRUSDKATANA_STAGECACHE_H
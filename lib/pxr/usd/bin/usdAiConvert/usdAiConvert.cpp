@@ -0,0 +1,358 @@
+// Converts the shaders, drivers and filters of .ass files to USD, loading
+// all the files in a single Arnold session.
+//
+//   usdAiConvert [options] file.ass...
+//
+// Each file is written to a .usdc next to it, or to the output directory.
+// Saving a file overlaps with loading and exporting the next one.
+
+#include "pxr/usd/usdAi/aiShaderExport.h"
+
+#include "pxr/usd/sdf/layer.h"
+#include "pxr/usd/usd/stage.h"
+
+#include <ai.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/tick_count.h>
+
+PXR_NAMESPACE_USING_DIRECTIVE
+
+namespace {
+
+    struct options {
+        std::vector<std::string> inputs;
+        std::vector<std::string> plugin_paths;
+        std::string output_dir;
+        std::string scope = "/Looks";
+        bool deduplicate = false;
+        bool sparse = false;
+        bool layer_authoring = false;
+        bool quiet = false;
+    };
+
+    struct file_stats {
+        double load_time = 0.0;
+        double export_time = 0.0;
+        double save_time = 0.0;
+        size_t nodes = 0;
+        bool ok = false;
+    };
+
+    void print_usage() {
+        std::printf(
+            "usage: usdAiConvert [options] file.ass...\n"
+            "  -o, --output-dir DIR  write the .usdc files to DIR instead of next to the inputs\n"
+            "  -l, --plugins DIR     load Arnold plugins from DIR, can be repeated\n"
+            "  --scope PATH          scope the nodes are exported under, /Looks by default\n"
+            "  --deduplicate         export identical nodes once\n"
+            "  --sparse              skip parameters with their default value\n"
+            "  --layer               author the layer directly instead of going through the stage\n"
+            "  -q, --quiet           only print the summary\n");
+    }
+
+    bool parse_options(int argc, char** argv, options& opts) {
+        for (auto i = 1; i < argc; ++i) {
+            const std::string arg(argv[i]);
+            auto next = [&] () -> const char* { return i + 1 < argc ? argv[++i] : nullptr; };
+            if (arg == "-h" || arg == "--help") {
+                return false;
+            } else if (arg == "-o" || arg == "--output-dir") {
+                const auto* value = next();
+                if (value == nullptr) { return false; }
+                opts.output_dir = value;
+            } else if (arg == "-l" || arg == "--plugins") {
+                const auto* value = next();
+                if (value == nullptr) { return false; }
+                opts.plugin_paths.push_back(value);
+            } else if (arg == "--scope") {
+                const auto* value = next();
+                if (value == nullptr) { return false; }
+                opts.scope = value;
+            } else if (arg == "--deduplicate") {
+                opts.deduplicate = true;
+            } else if (arg == "--sparse") {
+                opts.sparse = true;
+            } else if (arg == "--layer") {
+                opts.layer_authoring = true;
+            } else if (arg == "-q" || arg == "--quiet") {
+                opts.quiet = true;
+            } else if (!arg.empty() && arg[0] == '-') {
+                std::fprintf(stderr, "usdAiConvert: unknown option %s\n", arg.c_str());
+                return false;
+            } else {
+                opts.inputs.push_back(arg);
+            }
+        }
+        return !opts.inputs.empty();
+    }
+
+    // file.ass and file.ass.gz are both written to file.usdc.
+    std::string get_output_path(const std::string& input, const std::string& output_dir) {
+        auto name = input;
+        if (!output_dir.empty()) {
+            const auto slash = name.find_last_of('/');
+            if (slash != std::string::npos) {
+                name = name.substr(slash + 1);
+            }
+        }
+        for (const auto* ext : {".gz", ".ass"}) {
+            const auto len = std::strlen(ext);
+            if (name.size() > len && name.compare(name.size() - len, len, ext) == 0) {
+                name.resize(name.size() - len);
+            }
+        }
+        name += ".usdc";
+        return output_dir.empty() ? name : output_dir + "/" + name;
+    }
+
+    std::vector<AtNode*> get_nodes(int mask) {
+        std::vector<AtNode*> nodes;
+        auto* iter = AiUniverseGetNodeIterator(mask);
+        while (!AiNodeIteratorFinished(iter)) {
+            nodes.push_back(AiNodeIteratorGetNext(iter));
+        }
+        AiNodeIteratorDestroy(iter);
+        return nodes;
+    }
+
+    void setup_exporter(AiShaderExport& exporter, const options& opts) {
+        exporter.set_deduplicate_nodes(opts.deduplicate);
+        exporter.set_sparse(opts.sparse);
+        exporter.set_authoring_mode(opts.layer_authoring ?
+                                    AiShaderExport::AUTHORING_MODE_LAYER : AiShaderExport::AUTHORING_MODE_STAGE);
+    }
+
+    // Nodes linked to the inputs of a node, the way the exporter follows
+    // them: node parameters, whole inputs and their components, and array
+    // elements.
+    void add_links(const AtNode* node, const std::string& input, std::vector<const AtNode*>& upstream) {
+        const auto* linked = AiNodeGetLink(node, input.c_str());
+        if (linked != nullptr) {
+            upstream.push_back(linked);
+            return;
+        }
+        for (const auto* comp : {"r", "g", "b", "a", "x", "y", "z"}) {
+            linked = AiNodeGetLink(node, (input + "." + comp).c_str());
+            if (linked != nullptr) {
+                upstream.push_back(linked);
+            }
+        }
+    }
+
+    std::vector<const AtNode*> get_upstream(const AtNode* node) {
+        std::vector<const AtNode*> upstream;
+        auto* iter = AiNodeEntryGetParamIterator(AiNodeGetNodeEntry(node));
+        while (!AiParamIteratorFinished(iter)) {
+            const auto* pentry = AiParamIteratorGetNext(iter);
+            const auto name = AiParamGetName(pentry);
+            const auto type = AiParamGetType(pentry);
+            if (type == AI_TYPE_NODE) {
+                const auto* linked = reinterpret_cast<const AtNode*>(AiNodeGetPtr(node, name));
+                if (linked != nullptr) {
+                    upstream.push_back(linked);
+                }
+            } else if (type == AI_TYPE_ARRAY) {
+                const auto* arr = AiNodeGetArray(node, name);
+                const auto num_elements = arr == nullptr ? 0 : AiArrayGetNumElements(arr);
+                for (auto i = decltype(num_elements){0}; i < num_elements; ++i) {
+                    const auto element = std::string(name.c_str()) + "[" + std::to_string(i) + "]";
+                    if (AiNodeIsLinked(node, element.c_str())) {
+                        add_links(node, element, upstream);
+                    }
+                }
+            } else if (AiNodeIsLinked(node, name.c_str())) {
+                add_links(node, name.c_str(), upstream);
+            }
+        }
+        AiParamIteratorDestroy(iter);
+        return upstream;
+    }
+
+    // Exporting a node exports everything upstream of it, so only the nodes
+    // nothing is linked to are exported, plus one node of each cycle that
+    // can't be reached from them. Drivers and filters are always exported.
+    std::vector<const AtNode*> get_roots(const std::vector<AtNode*>& nodes) {
+        std::vector<std::vector<const AtNode*>> upstream(nodes.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, nodes.size()),
+            [&] (const tbb::blocked_range<size_t>& range) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    if (AiNodeEntryGetType(AiNodeGetNodeEntry(nodes[i])) == AI_NODE_SHADER) {
+                        upstream[i] = get_upstream(nodes[i]);
+                    }
+                }
+            });
+        std::unordered_map<const AtNode*, size_t> indices;
+        for (auto i = decltype(nodes.size()){0}; i < nodes.size(); ++i) {
+            indices.insert(std::make_pair(nodes[i], i));
+        }
+        std::vector<bool> linked(nodes.size(), false);
+        for (const auto& each : upstream) {
+            for (const auto* node : each) {
+                const auto it = indices.find(node);
+                if (it != indices.end()) {
+                    linked[it->second] = true;
+                }
+            }
+        }
+
+        std::vector<const AtNode*> roots;
+        std::vector<bool> reached(nodes.size(), false);
+        std::vector<size_t> stack;
+        auto add_root = [&] (size_t root) {
+            roots.push_back(nodes[root]);
+            reached[root] = true;
+            stack.push_back(root);
+            while (!stack.empty()) {
+                const auto i = stack.back();
+                stack.pop_back();
+                for (const auto* node : upstream[i]) {
+                    const auto it = indices.find(node);
+                    if (it != indices.end() && !reached[it->second]) {
+                        reached[it->second] = true;
+                        stack.push_back(it->second);
+                    }
+                }
+            }
+        };
+        for (auto i = decltype(nodes.size()){0}; i < nodes.size(); ++i) {
+            if (!linked[i]) {
+                add_root(i);
+            }
+        }
+        for (auto i = decltype(nodes.size()){0}; i < nodes.size(); ++i) {
+            if (!reached[i]) {
+                add_root(i);
+            }
+        }
+        return roots;
+    }
+
+    // Networks are gathered in parallel, then authored in order. The nodes
+    // in keep existed before the file was loaded, they are only exported
+    // when something loaded from the file is linked to them.
+    size_t export_nodes(const UsdStageRefPtr& stage, const options& opts,
+                        const std::unordered_set<AtNode*>& keep) {
+        AiShaderExport exporter(stage, SdfPath(opts.scope));
+        setup_exporter(exporter, opts);
+        auto nodes = get_nodes(AI_NODE_SHADER | AI_NODE_DRIVER | AI_NODE_FILTER);
+        nodes.erase(std::remove_if(nodes.begin(), nodes.end(),
+                                   [&keep] (AtNode* node) { return keep.find(node) != keep.end(); }),
+                    nodes.end());
+        const auto roots = get_roots(nodes);
+        const auto scope = SdfPath(opts.scope);
+        exporter.begin_concurrent_export();
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, roots.size()),
+            [&] (const tbb::blocked_range<size_t>& range) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    auto parent_path = scope;
+                    exporter.export_arnold_node(roots[i], parent_path);
+                }
+            });
+        exporter.end_concurrent_export();
+        return nodes.size();
+    }
+
+    // Removes everything the last file loaded, so the next one starts from
+    // the same universe.
+    void destroy_nodes(const std::unordered_set<AtNode*>& keep) {
+        const auto* options_node = AiUniverseGetOptions();
+        for (auto* node : get_nodes(AI_NODE_ALL)) {
+            if (node != options_node && keep.find(node) == keep.end()) {
+                AiNodeDestroy(node);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    options opts;
+    if (!parse_options(argc, argv, opts)) {
+        print_usage();
+        return 1;
+    }
+
+    AiBegin();
+    AiMsgSetConsoleFlags(AI_LOG_WARNINGS | AI_LOG_ERRORS);
+    for (const auto& path : opts.plugin_paths) {
+        AiLoadPlugins(path.c_str());
+    }
+    const auto builtin_nodes = get_nodes(AI_NODE_ALL);
+    const std::unordered_set<AtNode*> keep(builtin_nodes.begin(), builtin_nodes.end());
+
+    std::vector<file_stats> stats(opts.inputs.size());
+    std::future<void> pending_save;
+    const auto start = tbb::tick_count::now();
+    for (auto i = decltype(opts.inputs.size()){0}; i < opts.inputs.size(); ++i) {
+        const auto& input = opts.inputs[i];
+        auto& file = stats[i];
+        auto t0 = tbb::tick_count::now();
+        if (AiASSLoad(input.c_str(), AI_NODE_ALL) != AI_SUCCESS) {
+            std::fprintf(stderr, "usdAiConvert: failed to load %s\n", input.c_str());
+            destroy_nodes(keep);
+            continue;
+        }
+        auto t1 = tbb::tick_count::now();
+        file.load_time = (t1 - t0).seconds();
+
+        const auto output = get_output_path(input, opts.output_dir);
+        auto stage = UsdStage::CreateInMemory();
+        file.nodes = export_nodes(stage, opts, keep);
+        destroy_nodes(keep);
+        file.export_time = (tbb::tick_count::now() - t1).seconds();
+
+        // Only Arnold has to be serial, the previous file is saved while
+        // this one was loaded and exported.
+        if (pending_save.valid()) {
+            pending_save.wait();
+        }
+        pending_save = std::async(std::launch::async, [stage, output, &file, &opts, &input] () {
+            const auto t2 = tbb::tick_count::now();
+            file.ok = stage->GetRootLayer()->Export(output);
+            file.save_time = (tbb::tick_count::now() - t2).seconds();
+            if (!file.ok) {
+                std::fprintf(stderr, "usdAiConvert: failed to write %s\n", output.c_str());
+            } else if (!opts.quiet) {
+                std::printf("%s -> %s: %zu nodes, load %.3fs, export %.3fs, save %.3fs\n",
+                            input.c_str(), output.c_str(), file.nodes,
+                            file.load_time, file.export_time, file.save_time);
+            }
+        });
+    }
+    if (pending_save.valid()) {
+        pending_save.wait();
+    }
+    const auto total_time = (tbb::tick_count::now() - start).seconds();
+    AiEnd();
+
+    size_t converted = 0;
+    size_t nodes = 0;
+    file_stats totals;
+    for (const auto& file : stats) {
+        if (!file.ok) {
+            continue;
+        }
+        ++converted;
+        nodes += file.nodes;
+        totals.load_time += file.load_time;
+        totals.export_time += file.export_time;
+        totals.save_time += file.save_time;
+    }
+    std::printf("converted %zu of %zu files, %zu nodes in %.3fs "
+                "(load %.3fs, export %.3fs, save %.3fs), %.1f files/s, %.1f nodes/s\n",
+                converted, opts.inputs.size(), nodes, total_time,
+                totals.load_time, totals.export_time, totals.save_time,
+                total_time > 0.0 ? converted / total_time : 0.0,
+                total_time > 0.0 ? nodes / total_time : 0.0);
+    return converted == opts.inputs.size() ? 0 : 1;
+}
@@ -0,0 +1,661 @@
+#include "ai.h"
+
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <tbb/spin_rw_mutex.h>
+
+struct AtArray {
+    uint32_t nelements;
+    uint8_t nkeys;
+    uint8_t type;
+    std::vector<uint8_t> data;
+};
+
+struct AtParamEntry {
+    AtString name;
+    uint8_t type;
+    AtParamValue default_value;
+    std::vector<const char*> enums; // null terminated
+};
+
+struct AtNodeEntry {
+    AtString name;
+    int type;
+    int output_type;
+    std::deque<AtParamEntry> params;
+    std::unordered_map<const char*, size_t> indices;
+    std::vector<std::unique_ptr<AtArray>> default_arrays;
+    std::vector<std::unique_ptr<AtMatrix>> default_matrices;
+};
+
+struct AtNode {
+    struct link {
+        AtNode* src;
+        int comp;
+    };
+
+    const AtNodeEntry* entry;
+    AtString name;
+    std::vector<AtParamValue> values;
+    std::unordered_map<size_t, std::unique_ptr<AtArray>> arrays;
+    std::unordered_map<size_t, std::unique_ptr<AtMatrix>> matrices;
+    // Keyed by the interned input names, like "input1", "color.r" or "position[2]".
+    std::unordered_map<const char*, link> links;
+    // Inputs with some of their components or elements linked.
+    std::unordered_set<const char*> partially_linked;
+};
+
+struct AtUserParamEntry {
+    AtString name;
+    int type;
+};
+
+struct AtParamIterator {
+    const AtNodeEntry* entry;
+    size_t index;
+};
+
+struct AtUserParamIterator { };
+
+namespace {
+
+    // Strings are never released, like in Arnold.
+    struct string_pool {
+        struct hash {
+            size_t operator()(const char* str) const {
+                size_t h = 14695981039346656037ull;
+                for (; *str != '\0'; ++str) {
+                    h = (h ^ static_cast<unsigned char>(*str)) * 1099511628211ull;
+                }
+                return h;
+            }
+        };
+        struct equal {
+            bool operator()(const char* a, const char* b) const { return std::strcmp(a, b) == 0; }
+        };
+
+        const char* intern(const char* str) {
+            {
+                tbb::spin_rw_mutex::scoped_lock lock(mutex, false);
+                const auto it = interned.find(str);
+                if (it != interned.end()) {
+                    return *it;
+                }
+            }
+            tbb::spin_rw_mutex::scoped_lock lock(mutex, true);
+            const auto it = interned.find(str);
+            if (it != interned.end()) {
+                return *it;
+            }
+            storage.emplace_back(str);
+            return *interned.insert(storage.back().c_str()).first;
+        }
+
+        tbb::spin_rw_mutex mutex;
+        std::deque<std::string> storage;
+        std::unordered_set<const char*, hash, equal> interned;
+    };
+
+    string_pool& get_string_pool() {
+        static string_pool pool;
+        return pool;
+    }
+
+    struct universe {
+        std::deque<AtNodeEntry> entries;
+        std::unordered_map<const char*, const AtNodeEntry*> entries_by_name;
+        std::unordered_set<AtNode*> nodes;
+        std::mutex nodes_mutex;
+    };
+
+    std::unique_ptr<universe> the_universe;
+
+    size_t element_size(uint8_t type) {
+        switch (type) {
+            case AI_TYPE_BYTE: return sizeof(uint8_t);
+            case AI_TYPE_INT: return sizeof(int32_t);
+            case AI_TYPE_UINT: return sizeof(uint32_t);
+            case AI_TYPE_BOOLEAN: return sizeof(bool);
+            case AI_TYPE_FLOAT: return sizeof(float);
+            case AI_TYPE_RGB: return sizeof(AtRGB);
+            case AI_TYPE_RGBA: return sizeof(AtRGBA);
+            case AI_TYPE_VECTOR: return sizeof(AtVector);
+            case AI_TYPE_VECTOR2: return sizeof(AtVector2);
+            case AI_TYPE_STRING: return sizeof(AtString);
+            case AI_TYPE_MATRIX: return sizeof(AtMatrix);
+            case AI_TYPE_ENUM: return sizeof(int32_t);
+            default: return sizeof(void*);
+        }
+    }
+
+    template <typename T>
+    void set_element(AtArray* array, uint32_t i, uint8_t type, const T& val) {
+        if (array == nullptr || array->type != type || i >= array->nelements * array->nkeys) {
+            return;
+        }
+        std::memcpy(array->data.data() + i * sizeof(T), &val, sizeof(T));
+    }
+
+    AtParamValue zero_value() {
+        AtParamValue value;
+        std::memset(&value.m_vec, 0, sizeof(value.m_vec));
+        return value;
+    }
+
+    AtParamValue& add_param(AtNodeEntry& entry, const char* name, uint8_t type) {
+        entry.indices.insert(std::make_pair(AtString(name).c_str(), entry.params.size()));
+        entry.params.push_back(AtParamEntry {AtString(name), type, zero_value(), {}});
+        return entry.params.back().default_value;
+    }
+
+    void add_enum_param(AtNodeEntry& entry, const char* name, std::vector<const char*> enums) {
+        add_param(entry, name, AI_TYPE_ENUM);
+        enums.push_back(nullptr);
+        entry.params.back().enums = std::move(enums);
+    }
+
+    void add_array_param(AtNodeEntry& entry, const char* name, uint8_t type) {
+        entry.default_arrays.emplace_back(AiArrayAllocate(0, 1, type));
+        add_param(entry, name, AI_TYPE_ARRAY).m_array = entry.default_arrays.back().get();
+    }
+
+    void add_matrix_param(AtNodeEntry& entry, const char* name) {
+        entry.default_matrices.emplace_back(new AtMatrix {{{1.0f, 0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f, 0.0f},
+                                                           {0.0f, 0.0f, 1.0f, 0.0f}, {0.0f, 0.0f, 0.0f, 1.0f}}});
+        add_param(entry, name, AI_TYPE_MATRIX).m_matrix = entry.default_matrices.back().get();
+    }
+
+    AtNodeEntry& add_entry(universe& u, const char* name, int type, int output_type) {
+        u.entries.emplace_back();
+        auto& entry = u.entries.back();
+        entry.name = AtString(name);
+        entry.type = type;
+        entry.output_type = output_type;
+        u.entries_by_name.insert(std::make_pair(entry.name.c_str(), &entry));
+        add_param(entry, "name", AI_TYPE_STRING);
+        return entry;
+    }
+
+    // The parameters the benchmark networks use, with Arnold's defaults.
+    void install_entries(universe& u) {
+        const std::vector<const char*> operations = {
+            "over", "plus", "multiply", "min", "max", "difference", "divide", "subtract", "screen"};
+        auto& layer = add_entry(u, "layer_rgba", AI_NODE_SHADER, AI_TYPE_RGBA);
+        for (auto i = 1; i <= 8; ++i) {
+            const auto n = std::to_string(i);
+            add_param(layer, ("enable" + n).c_str(), AI_TYPE_BOOLEAN).m_bool = i == 1;
+            add_param(layer, ("name" + n).c_str(), AI_TYPE_STRING);
+            add_param(layer, ("input" + n).c_str(), AI_TYPE_RGBA);
+            add_param(layer, ("mix" + n).c_str(), AI_TYPE_FLOAT).m_flt = 1.0f;
+            add_enum_param(layer, ("operation" + n).c_str(), operations);
+        }
+        add_param(layer, "clamp", AI_TYPE_BOOLEAN);
+
+        auto& ramp = add_entry(u, "ramp_rgb", AI_NODE_SHADER, AI_TYPE_RGB);
+        add_enum_param(ramp, "type", {"custom", "v", "u", "diagonal", "radial", "circular", "box"});
+        add_param(ramp, "input", AI_TYPE_FLOAT);
+        add_array_param(ramp, "position", AI_TYPE_FLOAT);
+        add_array_param(ramp, "color", AI_TYPE_RGB);
+        add_array_param(ramp, "interpolation", AI_TYPE_INT);
+
+        // One entry per type, with a value and an array of that type, for
+        // measuring each type on its own.
+        const std::vector<std::pair<const char*, uint8_t>> types = {
+            {"byte", AI_TYPE_BYTE}, {"int", AI_TYPE_INT}, {"uint", AI_TYPE_UINT},
+            {"boolean", AI_TYPE_BOOLEAN}, {"float", AI_TYPE_FLOAT}, {"rgb", AI_TYPE_RGB},
+            {"rgba", AI_TYPE_RGBA}, {"vector", AI_TYPE_VECTOR}, {"vector2", AI_TYPE_VECTOR2},
+            {"string", AI_TYPE_STRING}, {"matrix", AI_TYPE_MATRIX}};
+        for (const auto& type : types) {
+            auto& entry = add_entry(u, (std::string("bench_") + type.first).c_str(), AI_NODE_SHADER, type.second);
+            if (type.second == AI_TYPE_MATRIX) {
+                add_matrix_param(entry, "value");
+            } else {
+                add_param(entry, "value", type.second);
+            }
+            add_array_param(entry, "values", type.second);
+        }
+    }
+
+    const AtParamValue* find_value(const AtNode* node, const AtString& param) {
+        if (node == nullptr) {
+            return nullptr;
+        }
+        const auto it = node->entry->indices.find(param.c_str());
+        return it == node->entry->indices.end() ? nullptr : &node->values[it->second];
+    }
+
+    AtParamValue* find_value(AtNode* node, const AtString& param, size_t* index = nullptr) {
+        if (node == nullptr) {
+            return nullptr;
+        }
+        const auto it = node->entry->indices.find(param.c_str());
+        if (it == node->entry->indices.end()) {
+            return nullptr;
+        }
+        if (index != nullptr) {
+            *index = it->second;
+        }
+        return &node->values[it->second];
+    }
+
+    int output_component(const char* output) {
+        if (output == nullptr || output[0] == '\0' || output[1] != '\0') {
+            return -1;
+        }
+        switch (output[0]) {
+            case 'r': case 'x': return 0;
+            case 'g': case 'y': return 1;
+            case 'b': case 'z': return 2;
+            case 'a': return 3;
+            default: return -1;
+        }
+    }
+}
+
+AtString::AtString(const char* str) :
+    m_str(str == nullptr ? nullptr : get_string_pool().intern(str)) {
+}
+
+void AiBegin() {
+    the_universe.reset(new universe);
+    install_entries(*the_universe);
+}
+
+void AiEnd() {
+    if (the_universe) {
+        for (auto* node : the_universe->nodes) {
+            delete node;
+        }
+    }
+    the_universe.reset();
+}
+
+AtNode* AiNode(const AtString nentry_name, const AtString name) {
+    if (!the_universe) {
+        return nullptr;
+    }
+    const auto it = the_universe->entries_by_name.find(nentry_name.c_str());
+    if (it == the_universe->entries_by_name.end()) {
+        return nullptr;
+    }
+    auto* node = new AtNode;
+    node->entry = it->second;
+    node->name = name;
+    node->values.reserve(node->entry->params.size());
+    for (const auto& param : node->entry->params) {
+        node->values.push_back(param.default_value);
+    }
+    std::lock_guard<std::mutex> lock(the_universe->nodes_mutex);
+    the_universe->nodes.insert(node);
+    return node;
+}
+
+// Links to the node from other nodes are left dangling.
+void AiNodeDestroy(AtNode* node) {
+    if (!the_universe || node == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(the_universe->nodes_mutex);
+        if (the_universe->nodes.erase(node) == 0) {
+            return;
+        }
+    }
+    delete node;
+}
+
+const AtNodeEntry* AiNodeGetNodeEntry(const AtNode* node) {
+    return node == nullptr ? nullptr : node->entry;
+}
+
+const char* AiNodeGetName(const AtNode* node) {
+    return node == nullptr || node->name.c_str() == nullptr ? "" : node->name.c_str();
+}
+
+bool AiNodeLinkOutput(AtNode* src, const char* output, AtNode* target, const char* input) {
+    if (src == nullptr || target == nullptr || input == nullptr) {
+        return false;
+    }
+    target->links[AtString(input).c_str()] = AtNode::link {src, output_component(output)};
+    // "input[1].r" partially links "input[1]" and "input".
+    const std::string name(input);
+    for (auto i = name.size(); i > 0; --i) {
+        if (name[i - 1] == '.' || name[i - 1] == '[') {
+            target->partially_linked.insert(AtString(name.substr(0, i - 1).c_str()).c_str());
+        }
+    }
+    return true;
+}
+
+bool AiNodeLink(AtNode* src, const char* input, AtNode* target) {
+    return AiNodeLinkOutput(src, "", target, input);
+}
+
+bool AiNodeIsLinked(const AtNode* node, const char* input) {
+    if (node == nullptr || input == nullptr) {
+        return false;
+    }
+    const auto* key = AtString(input).c_str();
+    return node->links.find(key) != node->links.end() ||
+           node->partially_linked.find(key) != node->partially_linked.end();
+}
+
+AtNode* AiNodeGetLink(const AtNode* node, const char* input, int* comp) {
+    if (comp != nullptr) {
+        *comp = -1;
+    }
+    if (node == nullptr || input == nullptr) {
+        return nullptr;
+    }
+    const auto it = node->links.find(AtString(input).c_str());
+    if (it == node->links.end()) {
+        return nullptr;
+    }
+    if (comp != nullptr) {
+        *comp = it->second.comp;
+    }
+    return it->second.src;
+}
+
+uint8_t AiNodeGetByte(const AtNode* node, const AtString param) {
+    const auto* value = find_value(node, param);
+    return value == nullptr ? 0 : value->BYTE();
+}
+
+int32_t AiNodeGetInt(const AtNode* node, const AtString param) {
+    const auto* value = find_value(node, param);
+    return value == nullptr ? 0 : value->INT();
+}
+
+uint32_t AiNodeGetUInt(const AtNode* node, const AtString param) {
+    const auto* value = find_value(node, param);
+    return value == nullptr ? 0 : value->UINT();
+}
+
+bool AiNodeGetBool(const AtNode* node, const AtString param) {
+    const auto* value = find_value(node, param);
+    return value != nullptr && value->BOOL();
+}
+
+float AiNodeGetFlt(const AtNode* node, const AtString param) {
+    const auto* value = find_value(node, param);
+    return value == nullptr ? 0.0f : value->FLT();
+}
+
+AtRGB AiNodeGetRGB(const AtNode* node, const AtString param) {
+    const auto* value = find_value(node, param);
+    return value == nullptr ? AtRGB(0.0f, 0.0f, 0.0f) : value->RGB();
+}
+
+AtRGBA AiNodeGetRGBA(const AtNode* node, const AtString param) {
+    const auto* value = find_value(node, param);
+    return value == nullptr ? AtRGBA(0.0f, 0.0f, 0.0f, 0.0f) : value->RGBA();
+}
+
+AtVector AiNodeGetVec(const AtNode* node, const AtString param) {
+    const auto* value = find_value(node, param);
+    return value == nullptr ? AtVector(0.0f, 0.0f, 0.0f) : value->VEC();
+}
+
+AtVector2 AiNodeGetVec2(const AtNode* node, const AtString param) {
+    const auto* value = find_value(node, param);
+    return value == nullptr ? AtVector2(0.0f, 0.0f) : value->VEC2();
+}
+
+AtString AiNodeGetStr(const AtNode* node, const AtString param) {
+    const auto* value = find_value(node, param);
+    return value == nullptr ? AtString() : value->STR();
+}
+
+void* AiNodeGetPtr(const AtNode* node, const AtString param) {
+    const auto* value = find_value(node, param);
+    return value == nullptr ? nullptr : value->PTR();
+}
+
+AtArray* AiNodeGetArray(const AtNode* node, const AtString param) {
+    const auto* value = find_value(node, param);
+    return value == nullptr ? nullptr : value->ARRAY();
+}
+
+AtMatrix AiNodeGetMatrix(const AtNode* node, const AtString param) {
+    const auto* value = find_value(node, param);
+    if (value != nullptr && value->pMTX() != nullptr) {
+        return *value->pMTX();
+    }
+    AtMatrix identity = {{{1.0f, 0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f, 0.0f},
+                          {0.0f, 0.0f, 1.0f, 0.0f}, {0.0f, 0.0f, 0.0f, 1.0f}}};
+    return identity;
+}
+
+void AiNodeSetByte(AtNode* node, const AtString param, uint8_t val) {
+    if (auto* value = find_value(node, param)) { value->m_byte = val; }
+}
+
+void AiNodeSetInt(AtNode* node, const AtString param, int32_t val) {
+    if (auto* value = find_value(node, param)) { value->m_int = val; }
+}
+
+void AiNodeSetUInt(AtNode* node, const AtString param, uint32_t val) {
+    if (auto* value = find_value(node, param)) { value->m_uint = val; }
+}
+
+void AiNodeSetBool(AtNode* node, const AtString param, bool val) {
+    if (auto* value = find_value(node, param)) { value->m_bool = val; }
+}
+
+void AiNodeSetFlt(AtNode* node, const AtString param, float val) {
+    if (auto* value = find_value(node, param)) { value->m_flt = val; }
+}
+
+void AiNodeSetRGB(AtNode* node, const AtString param, float r, float g, float b) {
+    if (auto* value = find_value(node, param)) {
+        value->m_vec[0] = r; value->m_vec[1] = g; value->m_vec[2] = b;
+    }
+}
+
+void AiNodeSetRGBA(AtNode* node, const AtString param, float r, float g, float b, float a) {
+    if (auto* value = find_value(node, param)) {
+        value->m_vec[0] = r; value->m_vec[1] = g; value->m_vec[2] = b; value->m_vec[3] = a;
+    }
+}
+
+void AiNodeSetVec(AtNode* node, const AtString param, float x, float y, float z) {
+    if (auto* value = find_value(node, param)) {
+        value->m_vec[0] = x; value->m_vec[1] = y; value->m_vec[2] = z;
+    }
+}
+
+void AiNodeSetVec2(AtNode* node, const AtString param, float x, float y) {
+    if (auto* value = find_value(node, param)) {
+        value->m_vec[0] = x; value->m_vec[1] = y;
+    }
+}
+
+void AiNodeSetStr(AtNode* node, const AtString param, const AtString str) {
+    if (auto* value = find_value(node, param)) { value->m_str = str; }
+}
+
+void AiNodeSetPtr(AtNode* node, const AtString param, void* ptr) {
+    if (auto* value = find_value(node, param)) { value->m_ptr = ptr; }
+}
+
+void AiNodeSetArray(AtNode* node, const AtString param, AtArray* array) {
+    size_t index = 0;
+    auto* value = find_value(node, param, &index);
+    if (value == nullptr) {
+        AiArrayDestroy(array);
+        return;
+    }
+    value->m_array = array;
+    node->arrays[index].reset(array);
+}
+
+void AiNodeSetMatrix(AtNode* node, const AtString param, AtMatrix matrix) {
+    size_t index = 0;
+    auto* value = find_value(node, param, &index);
+    if (value == nullptr) {
+        return;
+    }
+    auto& owned = node->matrices[index];
+    owned.reset(new AtMatrix(matrix));
+    value->m_matrix = owned.get();
+}
+
+AtUserParamIterator* AiNodeGetUserParamIterator(const AtNode*) {
+    return new AtUserParamIterator;
+}
+
+bool AiUserParamIteratorFinished(const AtUserParamIterator*) {
+    return true;
+}
+
+const AtUserParamEntry* AiUserParamIteratorGetNext(AtUserParamIterator*) {
+    return nullptr;
+}
+
+void AiUserParamIteratorDestroy(AtUserParamIterator* iter) {
+    delete iter;
+}
+
+const char* AiUserParamGetName(const AtUserParamEntry* upentry) {
+    return upentry == nullptr ? nullptr : upentry->name.c_str();
+}
+
+int AiUserParamGetType(const AtUserParamEntry* upentry) {
+    return upentry == nullptr ? AI_TYPE_NONE : upentry->type;
+}
+
+const AtNodeEntry* AiNodeEntryLookUp(const AtString name) {
+    if (!the_universe) {
+        return nullptr;
+    }
+    const auto it = the_universe->entries_by_name.find(name.c_str());
+    return it == the_universe->entries_by_name.end() ? nullptr : it->second;
+}
+
+const char* AiNodeEntryGetName(const AtNodeEntry* nentry) {
+    return nentry == nullptr ? nullptr : nentry->name.c_str();
+}
+
+int AiNodeEntryGetType(const AtNodeEntry* nentry) {
+    return nentry == nullptr ? AI_NODE_UNDEFINED : nentry->type;
+}
+
+int AiNodeEntryGetOutputType(const AtNodeEntry* nentry) {
+    return nentry == nullptr ? AI_TYPE_NONE : nentry->output_type;
+}
+
+int AiNodeEntryGetNumParams(const AtNodeEntry* nentry) {
+    return nentry == nullptr ? 0 : static_cast<int>(nentry->params.size());
+}
+
+const AtParamEntry* AiNodeEntryLookUpParameter(const AtNodeEntry* nentry, const AtString param) {
+    if (nentry == nullptr) {
+        return nullptr;
+    }
+    const auto it = nentry->indices.find(param.c_str());
+    return it == nentry->indices.end() ? nullptr : &nentry->params[it->second];
+}
+
+AtParamIterator* AiNodeEntryGetParamIterator(const AtNodeEntry* nentry) {
+    return new AtParamIterator {nentry, 0};
+}
+
+bool AiParamIteratorFinished(const AtParamIterator* iter) {
+    return iter->entry == nullptr || iter->index >= iter->entry->params.size();
+}
+
+const AtParamEntry* AiParamIteratorGetNext(AtParamIterator* iter) {
+    return AiParamIteratorFinished(iter) ? nullptr : &iter->entry->params[iter->index++];
+}
+
+void AiParamIteratorDestroy(AtParamIterator* iter) {
+    delete iter;
+}
+
+AtString AiParamGetName(const AtParamEntry* pentry) {
+    return pentry == nullptr ? AtString() : pentry->name;
+}
+
+uint8_t AiParamGetType(const AtParamEntry* pentry) {
+    return pentry == nullptr ? static_cast<uint8_t>(AI_TYPE_NONE) : pentry->type;
+}
+
+const AtParamValue* AiParamGetDefault(const AtParamEntry* pentry) {
+    return pentry == nullptr ? nullptr : &pentry->default_value;
+}
+
+AtEnum AiParamGetEnum(const AtParamEntry* pentry) {
+    return pentry == nullptr || pentry->enums.empty() ? nullptr : const_cast<AtEnum>(pentry->enums.data());
+}
+
+bool AiMetaDataGetBool(const AtNodeEntry*, const AtString, const AtString, bool*) {
+    return false;
+}
+
+AtArray* AiArrayAllocate(uint32_t nelements, uint8_t nkeys, uint8_t type) {
+    auto* array = new AtArray;
+    array->nelements = nelements;
+    array->nkeys = nkeys;
+    array->type = type;
+    array->data.resize(static_cast<size_t>(nelements) * nkeys * element_size(type), 0);
+    return array;
+}
+
+void AiArrayDestroy(AtArray* array) {
+    delete array;
+}
+
+uint32_t AiArrayGetNumElements(const AtArray* array) {
+    return array == nullptr ? 0 : array->nelements;
+}
+
+uint8_t AiArrayGetNumKeys(const AtArray* array) {
+    return array == nullptr ? 0 : array->nkeys;
+}
+
+uint8_t AiArrayGetType(const AtArray* array) {
+    return array == nullptr ? static_cast<uint8_t>(AI_TYPE_NONE) : array->type;
+}
+
+uint32_t AiArrayGetKeySize(const AtArray* array) {
+    return array == nullptr ? 0 : static_cast<uint32_t>(array->nelements * element_size(array->type));
+}
+
+void* AiArrayMap(AtArray* array) {
+    return array == nullptr || array->data.empty() ? nullptr : array->data.data();
+}
+
+void AiArrayUnmap(AtArray*) {
+}
+
+void AiArraySetByte(AtArray* array, uint32_t i, uint8_t val) {
+    set_element(array, i, AI_TYPE_BYTE, val);
+}
+
+void AiArraySetInt(AtArray* array, uint32_t i, int32_t val) {
+    set_element(array, i, AI_TYPE_INT, val);
+}
+
+void AiArraySetFlt(AtArray* array, uint32_t i, float val) {
+    set_element(array, i, AI_TYPE_FLOAT, val);
+}
+
+void AiArraySetRGB(AtArray* array, uint32_t i, AtRGB val) {
+    set_element(array, i, AI_TYPE_RGB, val);
+}
+
+void AiArraySetRGBA(AtArray* array, uint32_t i, AtRGBA val) {
+    set_element(array, i, AI_TYPE_RGBA, val);
+}
+
+void AiArraySetStr(AtArray* array, uint32_t i, const AtString val) {
+    set_element(array, i, AI_TYPE_STRING, val);
+}
@@ -0,0 +1,211 @@
+// Stand-in for the subset of the Arnold 5 API used by AiShaderExport, so
+// the exporter can be built and measured without an Arnold installation.
+//
+// Only what the exporter reads and what the benchmark needs to build
+// networks is implemented. Node entries are built in, see ai.cpp, there
+// are no plugins, user parameters or metadata. Reading nodes is thread
+// safe, creating, linking and setting them has to happen from one thread.
+
+#ifndef USDAI_MOCK_AI_H
+#define USDAI_MOCK_AI_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define AI_TYPE_BYTE          0x00
+#define AI_TYPE_INT           0x01
+#define AI_TYPE_UINT          0x02
+#define AI_TYPE_BOOLEAN       0x03
+#define AI_TYPE_FLOAT         0x04
+#define AI_TYPE_RGB           0x05
+#define AI_TYPE_RGBA          0x06
+#define AI_TYPE_VECTOR        0x07
+#define AI_TYPE_VECTOR2       0x08
+#define AI_TYPE_STRING        0x09
+#define AI_TYPE_POINTER       0x0A
+#define AI_TYPE_NODE          0x0B
+#define AI_TYPE_ARRAY         0x0C
+#define AI_TYPE_MATRIX        0x0D
+#define AI_TYPE_ENUM          0x0E
+#define AI_TYPE_CLOSURE       0x0F
+#define AI_TYPE_NONE          0xFF
+
+#define AI_NODE_UNDEFINED     0x0000
+#define AI_NODE_OPTIONS       0x0001
+#define AI_NODE_CAMERA        0x0002
+#define AI_NODE_LIGHT         0x0004
+#define AI_NODE_SHAPE         0x0008
+#define AI_NODE_SHADER        0x0010
+#define AI_NODE_OVERRIDE      0x0020
+#define AI_NODE_DRIVER        0x0040
+#define AI_NODE_FILTER        0x0080
+#define AI_NODE_ALL           0xFFFF
+
+// Interned like Arnold's, so comparing is comparing pointers. Empty
+// strings read as "", the exporter converts them to std::string directly.
+class AtString {
+public:
+    AtString() : m_str(nullptr) { }
+    AtString(const char* str);
+    const char* c_str() const { return m_str == nullptr ? "" : m_str; }
+    bool empty() const { return m_str == nullptr || m_str[0] == '\0'; }
+    bool operator==(const AtString& other) const { return m_str == other.m_str; }
+    bool operator!=(const AtString& other) const { return m_str != other.m_str; }
+private:
+    const char* m_str;
+};
+
+struct AtRGB {
+    AtRGB() = default;
+    AtRGB(float _r, float _g, float _b) : r(_r), g(_g), b(_b) { }
+    float r, g, b;
+};
+
+struct AtRGBA {
+    AtRGBA() = default;
+    AtRGBA(float _r, float _g, float _b, float _a) : r(_r), g(_g), b(_b), a(_a) { }
+    float r, g, b, a;
+};
+
+struct AtVector {
+    AtVector() = default;
+    AtVector(float _x, float _y, float _z) : x(_x), y(_y), z(_z) { }
+    float x, y, z;
+};
+
+struct AtVector2 {
+    AtVector2() = default;
+    AtVector2(float _x, float _y) : x(_x), y(_y) { }
+    float x, y;
+};
+
+struct AtMatrix {
+    float data[4][4];
+};
+
+using AtEnum = const char**;
+
+struct AtArray;
+struct AtNode;
+struct AtNodeEntry;
+struct AtParamEntry;
+struct AtUserParamEntry;
+struct AtParamIterator;
+struct AtUserParamIterator;
+
+// Parameter values and defaults. Matrices and arrays are owned by the node
+// or the node entry holding the value.
+struct AtParamValue {
+    uint8_t BYTE() const { return m_byte; }
+    int32_t INT() const { return m_int; }
+    uint32_t UINT() const { return m_uint; }
+    bool BOOL() const { return m_bool; }
+    float FLT() const { return m_flt; }
+    AtRGB RGB() const { return AtRGB(m_vec[0], m_vec[1], m_vec[2]); }
+    AtRGBA RGBA() const { return AtRGBA(m_vec[0], m_vec[1], m_vec[2], m_vec[3]); }
+    AtVector VEC() const { return AtVector(m_vec[0], m_vec[1], m_vec[2]); }
+    AtVector2 VEC2() const { return AtVector2(m_vec[0], m_vec[1]); }
+    const AtString& STR() const { return m_str; }
+    void* PTR() const { return m_ptr; }
+    AtArray* ARRAY() const { return m_array; }
+    const AtMatrix* pMTX() const { return m_matrix; }
+
+    union {
+        uint8_t m_byte;
+        int32_t m_int;
+        uint32_t m_uint;
+        bool m_bool;
+        float m_flt;
+        float m_vec[4];
+        void* m_ptr;
+        AtArray* m_array;
+        AtMatrix* m_matrix;
+    };
+    AtString m_str;
+};
+
+// Universe
+void AiBegin();
+void AiEnd();
+
+// Nodes
+AtNode* AiNode(const AtString nentry_name, const AtString name = AtString());
+void AiNodeDestroy(AtNode* node);
+const AtNodeEntry* AiNodeGetNodeEntry(const AtNode* node);
+const char* AiNodeGetName(const AtNode* node);
+bool AiNodeLink(AtNode* src, const char* input, AtNode* target);
+bool AiNodeLinkOutput(AtNode* src, const char* output, AtNode* target, const char* input);
+bool AiNodeIsLinked(const AtNode* node, const char* input);
+AtNode* AiNodeGetLink(const AtNode* node, const char* input, int* comp = nullptr);
+
+uint8_t AiNodeGetByte(const AtNode* node, const AtString param);
+int32_t AiNodeGetInt(const AtNode* node, const AtString param);
+uint32_t AiNodeGetUInt(const AtNode* node, const AtString param);
+bool AiNodeGetBool(const AtNode* node, const AtString param);
+float AiNodeGetFlt(const AtNode* node, const AtString param);
+AtRGB AiNodeGetRGB(const AtNode* node, const AtString param);
+AtRGBA AiNodeGetRGBA(const AtNode* node, const AtString param);
+AtVector AiNodeGetVec(const AtNode* node, const AtString param);
+AtVector2 AiNodeGetVec2(const AtNode* node, const AtString param);
+AtString AiNodeGetStr(const AtNode* node, const AtString param);
+void* AiNodeGetPtr(const AtNode* node, const AtString param);
+AtArray* AiNodeGetArray(const AtNode* node, const AtString param);
+AtMatrix AiNodeGetMatrix(const AtNode* node, const AtString param);
+
+void AiNodeSetByte(AtNode* node, const AtString param, uint8_t val);
+void AiNodeSetInt(AtNode* node, const AtString param, int32_t val);
+void AiNodeSetUInt(AtNode* node, const AtString param, uint32_t val);
+void AiNodeSetBool(AtNode* node, const AtString param, bool val);
+void AiNodeSetFlt(AtNode* node, const AtString param, float val);
+void AiNodeSetRGB(AtNode* node, const AtString param, float r, float g, float b);
+void AiNodeSetRGBA(AtNode* node, const AtString param, float r, float g, float b, float a);
+void AiNodeSetVec(AtNode* node, const AtString param, float x, float y, float z);
+void AiNodeSetVec2(AtNode* node, const AtString param, float x, float y);
+void AiNodeSetStr(AtNode* node, const AtString param, const AtString str);
+void AiNodeSetPtr(AtNode* node, const AtString param, void* ptr);
+// The node takes ownership of the array.
+void AiNodeSetArray(AtNode* node, const AtString param, AtArray* array);
+void AiNodeSetMatrix(AtNode* node, const AtString param, AtMatrix matrix);
+
+AtUserParamIterator* AiNodeGetUserParamIterator(const AtNode* node);
+bool AiUserParamIteratorFinished(const AtUserParamIterator* iter);
+const AtUserParamEntry* AiUserParamIteratorGetNext(AtUserParamIterator* iter);
+void AiUserParamIteratorDestroy(AtUserParamIterator* iter);
+const char* AiUserParamGetName(const AtUserParamEntry* upentry);
+int AiUserParamGetType(const AtUserParamEntry* upentry);
+
+// Node entries
+const AtNodeEntry* AiNodeEntryLookUp(const AtString name);
+const char* AiNodeEntryGetName(const AtNodeEntry* nentry);
+int AiNodeEntryGetType(const AtNodeEntry* nentry);
+int AiNodeEntryGetOutputType(const AtNodeEntry* nentry);
+int AiNodeEntryGetNumParams(const AtNodeEntry* nentry);
+const AtParamEntry* AiNodeEntryLookUpParameter(const AtNodeEntry* nentry, const AtString param);
+AtParamIterator* AiNodeEntryGetParamIterator(const AtNodeEntry* nentry);
+bool AiParamIteratorFinished(const AtParamIterator* iter);
+const AtParamEntry* AiParamIteratorGetNext(AtParamIterator* iter);
+void AiParamIteratorDestroy(AtParamIterator* iter);
+AtString AiParamGetName(const AtParamEntry* pentry);
+uint8_t AiParamGetType(const AtParamEntry* pentry);
+const AtParamValue* AiParamGetDefault(const AtParamEntry* pentry);
+AtEnum AiParamGetEnum(const AtParamEntry* pentry);
+// There is no metadata, this always returns false.
+bool AiMetaDataGetBool(const AtNodeEntry* nentry, const AtString param, const AtString name, bool* value);
+
+// Arrays
+AtArray* AiArrayAllocate(uint32_t nelements, uint8_t nkeys, uint8_t type);
+void AiArrayDestroy(AtArray* array);
+uint32_t AiArrayGetNumElements(const AtArray* array);
+uint8_t AiArrayGetNumKeys(const AtArray* array);
+uint8_t AiArrayGetType(const AtArray* array);
+uint32_t AiArrayGetKeySize(const AtArray* array);
+void* AiArrayMap(AtArray* array);
+void AiArrayUnmap(AtArray* array);
+void AiArraySetByte(AtArray* array, uint32_t i, uint8_t val);
+void AiArraySetInt(AtArray* array, uint32_t i, int32_t val);
+void AiArraySetFlt(AtArray* array, uint32_t i, float val);
+void AiArraySetRGB(AtArray* array, uint32_t i, AtRGB val);
+void AiArraySetRGBA(AtArray* array, uint32_t i, AtRGBA val);
+void AiArraySetStr(AtArray* array, uint32_t i, const AtString val);
+
+#endif // USDAI_MOCK_AI_H
@@ -0,0 +1,561 @@
+// Measures the shader export throughput on generated networks, built
+// against the mock Arnold API in mock/, so it runs without Arnold.
+//
+//   usdAiExportBench [options] [N...]
+//
+// Exports materials until there are at least N nodes, for each N, 1000,
+// 10000 and 100000 by default. Nothing is written. The usdAi schema
+// classes are compiled in, the usdAi plugin doesn't have to be found.
+//
+// With --types, N nodes of each parameter type are exported instead, each
+// with a value and an array of that type. With --concurrent, the networks
+// share subgraphs and are exported from several threads, and the result
+// is checked against the serial export.
+
+#include "pxr/usd/usdAi/aiShaderExport.h"
+
+#include "pxr/usd/sdf/layer.h"
+#include "pxr/usd/usd/attribute.h"
+#include "pxr/usd/usd/primRange.h"
+#include "pxr/usd/usd/relationship.h"
+#include "pxr/usd/usd/stage.h"
+
+#include <ai.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <tbb/tick_count.h>
+
+PXR_NAMESPACE_USING_DIRECTIVE
+
+namespace {
+
+    // Networks are trees of layer_rgba nodes with ramp_rgb leaves.
+    struct options {
+        std::vector<size_t> sizes;
+        std::vector<AiShaderExport::AuthoringMode> authoring_modes = {AiShaderExport::AUTHORING_MODE_STAGE};
+        std::string scope = "/Looks";
+        int depth = 4;
+        int fanout = 4;
+        int array_length = 16;
+        int threads = 0;
+        int runs = 3;
+        bool deduplicate = false;
+        bool sparse = false;
+        bool types = false;
+        bool quiet = false;
+    };
+
+    void print_usage() {
+        std::printf(
+            "usage: usdAiExportBench [options] [N...]\n"
+            "  N                     export generated networks of N nodes, 1000 10000 100000 by default\n"
+            "  --depth N             depth of the generated networks, 4 by default\n"
+            "  --fanout N            inputs linked per generated node, 1 to 8, 4 by default\n"
+            "  --array-length N      length of the generated arrays, 16 by default\n"
+            "  --scope PATH          scope the materials are exported under, /Looks by default\n"
+            "  --deduplicate         export identical nodes once\n"
+            "  --sparse              skip parameters with their default value\n"
+            "  --authoring MODE      stage, layer or both, stage by default\n"
+            "  --types               export N nodes of each parameter type instead of networks\n"
+            "  --concurrent N        export from N threads and check the result against the serial export\n"
+            "  --runs N              concurrent exports checked for each size, 3 by default\n"
+            "  -q, --quiet           only print the summary\n");
+    }
+
+    bool parse_options(int argc, char** argv, options& opts) {
+        for (auto i = 1; i < argc; ++i) {
+            const std::string arg(argv[i]);
+            auto next = [&] () -> const char* { return i + 1 < argc ? argv[++i] : nullptr; };
+            if (arg == "-h" || arg == "--help") {
+                return false;
+            } else if (arg == "--depth" || arg == "--fanout" || arg == "--array-length" ||
+                       arg == "--concurrent" || arg == "--runs") {
+                const auto* value = next();
+                if (value == nullptr) { return false; }
+                auto& field = arg == "--depth" ? opts.depth : arg == "--fanout" ? opts.fanout :
+                              arg == "--array-length" ? opts.array_length :
+                              arg == "--concurrent" ? opts.threads : opts.runs;
+                field = std::atoi(value);
+                if (field < 1) { return false; }
+            } else if (arg == "--scope") {
+                const auto* value = next();
+                if (value == nullptr) { return false; }
+                opts.scope = value;
+            } else if (arg == "--authoring") {
+                const auto* value = next();
+                if (value == nullptr) { return false; }
+                const std::string mode(value);
+                if (mode == "stage") {
+                    opts.authoring_modes = {AiShaderExport::AUTHORING_MODE_STAGE};
+                } else if (mode == "layer") {
+                    opts.authoring_modes = {AiShaderExport::AUTHORING_MODE_LAYER};
+                } else if (mode == "both") {
+                    opts.authoring_modes = {AiShaderExport::AUTHORING_MODE_STAGE, AiShaderExport::AUTHORING_MODE_LAYER};
+                } else {
+                    return false;
+                }
+            } else if (arg == "--deduplicate") {
+                opts.deduplicate = true;
+            } else if (arg == "--sparse") {
+                opts.sparse = true;
+            } else if (arg == "--types") {
+                opts.types = true;
+            } else if (arg == "-q" || arg == "--quiet") {
+                opts.quiet = true;
+            } else if (!arg.empty() && arg[0] == '-') {
+                std::fprintf(stderr, "usdAiExportBench: unknown option %s\n", arg.c_str());
+                return false;
+            } else {
+                char* end = nullptr;
+                const auto size = std::strtoul(arg.c_str(), &end, 10);
+                if (*end != '\0' || size == 0) { return false; }
+                opts.sizes.push_back(size);
+            }
+        }
+        opts.fanout = std::min(opts.fanout, 8);
+        if (opts.sizes.empty()) {
+            opts.sizes = {1000, 10000, 100000};
+        }
+        return true;
+    }
+
+    const char* get_mode_name(AiShaderExport::AuthoringMode mode) {
+        return mode == AiShaderExport::AUTHORING_MODE_LAYER ? "layer" : "stage";
+    }
+
+    void setup_exporter(AiShaderExport& exporter, const options& opts, AiShaderExport::AuthoringMode mode) {
+        exporter.set_deduplicate_nodes(opts.deduplicate);
+        exporter.set_sparse(opts.sparse);
+        exporter.set_authoring_mode(mode);
+    }
+
+    void print_stats(const AiShaderExport::export_stats& stats) {
+        std::printf("  %zu inputs, %zu connections, %zu arrays (%zu bytes), %zu nodes deduplicated\n",
+                    stats.inputs_authored, stats.connections_authored, stats.arrays_copied,
+                    stats.array_bytes_copied, stats.nodes_deduplicated);
+    }
+
+    // Connections are authored on the input attributes, relationships are
+    // only expected for the material bindings.
+    void print_connections(const UsdStageRefPtr& stage) {
+        size_t connections = 0;
+        size_t relationships = 0;
+        SdfPathVector targets;
+        for (const auto& prim : stage->Traverse()) {
+            for (const auto& attr : prim.GetAuthoredAttributes()) {
+                if (attr.GetConnections(&targets)) {
+                    connections += targets.size();
+                }
+            }
+            relationships += prim.GetAuthoredRelationships().size();
+        }
+        std::printf("  %zu attribute connections, %zu relationships\n", connections, relationships);
+    }
+
+    // Builds a tree of the configured depth and fanout, returns the root and
+    // adds the number of nodes created to count. Ramp values only differ
+    // between trees, so with deduplication each tree collapses to a chain.
+    AtNode* make_tree(const options& opts, const std::string& prefix, int depth, float seed, size_t& count) {
+        const auto name = prefix + "_" + std::to_string(count++);
+        if (depth <= 1) {
+            auto* ramp = AiNode("ramp_rgb", name.c_str());
+            const auto length = static_cast<uint32_t>(opts.array_length);
+            auto* positions = AiArrayAllocate(length, 1, AI_TYPE_FLOAT);
+            auto* colors = AiArrayAllocate(length, 1, AI_TYPE_RGB);
+            for (auto i = decltype(length){0}; i < length; ++i) {
+                const auto t = static_cast<float>(i) / static_cast<float>(length);
+                AiArraySetFlt(positions, i, t);
+                AiArraySetRGB(colors, i, AtRGB(t, 1.0f - t, seed));
+            }
+            AiNodeSetArray(ramp, "position", positions);
+            AiNodeSetArray(ramp, "color", colors);
+            return ramp;
+        }
+        auto* layer = AiNode("layer_rgba", name.c_str());
+        for (auto i = 1; i <= opts.fanout; ++i) {
+            const auto n = std::to_string(i);
+            AiNodeSetBool(layer, ("enable" + n).c_str(), true);
+            AiNodeLink(make_tree(opts, prefix, depth - 1, seed, count), ("input" + n).c_str(), layer);
+        }
+        return layer;
+    }
+
+    // Generates materials until there are at least node_count nodes, and
+    // returns the export time.
+    double run(const options& opts, size_t node_count, AiShaderExport::AuthoringMode mode) {
+        AiBegin();
+        const auto t0 = tbb::tick_count::now();
+        std::vector<AiShaderExport::material_desc> materials;
+        size_t count = 0;
+        while (count < node_count) {
+            const auto name = "synthetic_" + std::to_string(materials.size());
+            const auto seed = static_cast<float>(materials.size() % 1000) / 1000.0f;
+            materials.push_back(AiShaderExport::material_desc {
+                name, make_tree(opts, name, opts.depth, seed, count), nullptr});
+        }
+        const auto t1 = tbb::tick_count::now();
+
+        auto stage = UsdStage::CreateInMemory();
+        AiShaderExport exporter(stage, SdfPath(opts.scope));
+        setup_exporter(exporter, opts, mode);
+        exporter.export_materials(materials);
+        const auto t2 = tbb::tick_count::now();
+        AiEnd();
+
+        const auto stats = exporter.get_stats();
+        const auto export_time = (t2 - t1).seconds();
+        std::printf("%zu nodes in %zu materials, %s authoring: generate %.3fs, export %.3fs "
+                    "(gather %.3fs, merge %.3fs, author %.3fs), %.1f nodes/s\n",
+                    count, materials.size(), get_mode_name(mode), (t1 - t0).seconds(), export_time,
+                    stats.gather_time, stats.merge_time, stats.author_time,
+                    export_time > 0.0 ? count / export_time : 0.0);
+        if (!opts.quiet) {
+            print_stats(stats);
+            // The size of the exported layer, to compare sparse and dense
+            // exports.
+            std::string layer;
+            stage->GetRootLayer()->ExportToString(&layer);
+            std::printf("  %zu bytes of usda\n", layer.size());
+            print_connections(stage);
+        }
+        return export_time;
+    }
+
+    template <typename T, typename F>
+    void fill_array(AtArray* arr, F make) {
+        auto* data = static_cast<T*>(AiArrayMap(arr));
+        const auto length = AiArrayGetNumElements(arr);
+        for (auto i = decltype(length){0}; i < length; ++i) {
+            data[i] = make(static_cast<float>(i));
+        }
+        AiArrayUnmap(arr);
+    }
+
+    AtMatrix make_matrix(float v) {
+        AtMatrix m = {{{v, 0.0f, 0.0f, 0.0f}, {0.0f, v, 0.0f, 0.0f}, {0.0f, 0.0f, v, 0.0f}, {v, v, v, 1.0f}}};
+        return m;
+    }
+
+    // Sets the value and the array of a bench_<type> node, values depend on
+    // the seed so nodes are not identical.
+    void set_type_values(AtNode* node, uint8_t type, uint32_t length, float seed) {
+        auto* arr = AiArrayAllocate(length, 1, type);
+        switch (type) {
+            case AI_TYPE_BYTE:
+                AiNodeSetByte(node, "value", static_cast<uint8_t>(seed));
+                fill_array<uint8_t>(arr, [seed] (float i) { return static_cast<uint8_t>(i + seed); });
+                break;
+            case AI_TYPE_INT:
+                AiNodeSetInt(node, "value", static_cast<int32_t>(seed));
+                fill_array<int32_t>(arr, [seed] (float i) { return static_cast<int32_t>(i + seed); });
+                break;
+            case AI_TYPE_UINT:
+                AiNodeSetUInt(node, "value", static_cast<uint32_t>(seed));
+                fill_array<uint32_t>(arr, [seed] (float i) { return static_cast<uint32_t>(i + seed); });
+                break;
+            case AI_TYPE_BOOLEAN:
+                AiNodeSetBool(node, "value", true);
+                fill_array<bool>(arr, [seed] (float i) { return static_cast<int>(i + seed) % 2 == 0; });
+                break;
+            case AI_TYPE_FLOAT:
+                AiNodeSetFlt(node, "value", seed);
+                fill_array<float>(arr, [seed] (float i) { return i + seed; });
+                break;
+            case AI_TYPE_RGB:
+                AiNodeSetRGB(node, "value", seed, seed, seed);
+                fill_array<AtRGB>(arr, [seed] (float i) { return AtRGB(i, seed, 1.0f); });
+                break;
+            case AI_TYPE_RGBA:
+                AiNodeSetRGBA(node, "value", seed, seed, seed, 1.0f);
+                fill_array<AtRGBA>(arr, [seed] (float i) { return AtRGBA(i, seed, 1.0f, 1.0f); });
+                break;
+            case AI_TYPE_VECTOR:
+                AiNodeSetVec(node, "value", seed, seed, seed);
+                fill_array<AtVector>(arr, [seed] (float i) { return AtVector(i, seed, 1.0f); });
+                break;
+            case AI_TYPE_VECTOR2:
+                AiNodeSetVec2(node, "value", seed, seed);
+                fill_array<AtVector2>(arr, [seed] (float i) { return AtVector2(i, seed); });
+                break;
+            case AI_TYPE_STRING: {
+                const auto prefix = std::to_string(static_cast<int>(seed)) + "_";
+                AiNodeSetStr(node, "value", prefix.c_str());
+                for (auto i = decltype(length){0}; i < length; ++i) {
+                    AiArraySetStr(arr, i, (prefix + std::to_string(i)).c_str());
+                }
+                break;
+            }
+            case AI_TYPE_MATRIX:
+                AiNodeSetMatrix(node, "value", make_matrix(seed));
+                fill_array<AtMatrix>(arr, [seed] (float i) { return make_matrix(i + seed); });
+                break;
+            default:
+                break;
+        }
+        AiNodeSetArray(node, "values", arr);
+    }
+
+    // Exports node_count nodes of each bench_<type> entry, each as the
+    // surface of its own material, and reports the throughput per type.
+    void run_types(const options& opts, size_t node_count, AiShaderExport::AuthoringMode mode) {
+        const std::vector<std::pair<const char*, uint8_t>> types = {
+            {"byte", AI_TYPE_BYTE}, {"int", AI_TYPE_INT}, {"uint", AI_TYPE_UINT},
+            {"boolean", AI_TYPE_BOOLEAN}, {"float", AI_TYPE_FLOAT}, {"rgb", AI_TYPE_RGB},
+            {"rgba", AI_TYPE_RGBA}, {"vector", AI_TYPE_VECTOR}, {"vector2", AI_TYPE_VECTOR2},
+            {"string", AI_TYPE_STRING}, {"matrix", AI_TYPE_MATRIX}};
+        const auto length = static_cast<uint32_t>(opts.array_length);
+        std::printf("%zu nodes per type, arrays of %u, %s authoring\n", node_count, length, get_mode_name(mode));
+        AiBegin();
+        for (const auto& type : types) {
+            const auto entry_name = std::string("bench_") + type.first;
+            std::vector<AiShaderExport::material_desc> materials;
+            materials.reserve(node_count);
+            for (auto i = decltype(node_count){0}; i < node_count; ++i) {
+                const auto name = std::string(type.first) + "_" + std::to_string(i);
+                auto* node = AiNode(entry_name.c_str(), name.c_str());
+                set_type_values(node, type.second, length, static_cast<float>(i % 256));
+                materials.push_back(AiShaderExport::material_desc {name, node, nullptr});
+            }
+
+            auto stage = UsdStage::CreateInMemory();
+            AiShaderExport exporter(stage, SdfPath(opts.scope));
+            setup_exporter(exporter, opts, mode);
+            const auto t0 = tbb::tick_count::now();
+            exporter.export_materials(materials);
+            const auto export_time = (tbb::tick_count::now() - t0).seconds();
+            const auto stats = exporter.get_stats();
+            std::printf("  %-8s export %.3fs (gather %.3fs, author %.3fs), %.1f nodes/s, %.1f MB/s copied\n",
+                        type.first, export_time, stats.gather_time, stats.author_time,
+                        export_time > 0.0 ? node_count / export_time : 0.0,
+                        export_time > 0.0 ? stats.array_bytes_copied / export_time / (1024.0 * 1024.0) : 0.0);
+            for (const auto& material : materials) {
+                AiNodeDestroy(material.surf_shader);
+            }
+        }
+        AiEnd();
+    }
+
+    // Materials link their own tree and two shared ones, and there are loose
+    // nodes no material uses. Every other shared and loose name is written
+    // with a colon, so pairs of names clean up to the same prim name.
+    struct concurrent_scene {
+        std::vector<std::pair<std::string, AtNode*>> materials;
+        std::vector<const AtNode*> nodes;
+        size_t node_count = 0;
+    };
+
+    std::string make_colliding_name(const char* prefix, size_t i) {
+        return prefix + std::string(i % 2 == 0 ? "_" : ":") + std::to_string(i / 2);
+    }
+
+    concurrent_scene make_concurrent_scene(const options& opts, size_t node_count) {
+        concurrent_scene scene;
+        std::vector<AtNode*> shared;
+        const auto shared_count = std::max(node_count / 64, size_t{2});
+        for (auto i = decltype(shared_count){0}; i < shared_count; ++i) {
+            // Counters start from zero for each tree, so the nodes of a pair
+            // of trees collide too.
+            size_t shared_nodes = 0;
+            shared.push_back(make_tree(opts, make_colliding_name("shared", i), std::max(opts.depth - 1, 1),
+                                       0.5f, shared_nodes));
+            scene.nodes.push_back(shared.back());
+            size_t loose_nodes = 0;
+            scene.nodes.push_back(make_tree(opts, make_colliding_name("loose", i), 1, 0.25f, loose_nodes));
+            scene.node_count += shared_nodes + loose_nodes;
+        }
+        while (scene.node_count < node_count) {
+            const auto index = scene.materials.size();
+            char name[32];
+            std::snprintf(name, sizeof(name), "material_%08zu", index);
+            auto* root = AiNode("layer_rgba", (std::string(name) + "_root").c_str());
+            ++scene.node_count;
+            AiNodeSetBool(root, "enable1", true);
+            AiNodeLink(make_tree(opts, name, std::max(opts.depth - 1, 1),
+                                 static_cast<float>(index % 1000) / 1000.0f, scene.node_count), "input1", root);
+            AiNodeSetBool(root, "enable2", true);
+            AiNodeLink(shared[index % shared_count], "input2", root);
+            AiNodeSetBool(root, "enable3", true);
+            AiNodeLink(shared[(index + 1) % shared_count], "input3", root);
+            scene.materials.push_back(std::make_pair(std::string(name), root));
+        }
+        return scene;
+    }
+
+    // Every authored prim, property, value and target, sorted, so stages
+    // can be compared regardless of the order prims were created in.
+    std::vector<std::string> dump_stage(const UsdStageRefPtr& stage) {
+        std::vector<std::string> lines;
+        SdfPathVector targets;
+        for (const auto& prim : stage->Traverse()) {
+            lines.push_back(prim.GetPath().GetString() + " " + prim.GetTypeName().GetString());
+            for (const auto& attr : prim.GetAuthoredAttributes()) {
+                std::ostringstream line;
+                line << attr.GetPath().GetString() << " " << attr.GetTypeName().GetAsToken().GetString();
+                VtValue value;
+                if (attr.Get(&value)) {
+                    line << " = " << value;
+                }
+                if (attr.GetConnections(&targets)) {
+                    for (const auto& target : targets) {
+                        line << " <- " << target.GetString();
+                    }
+                }
+                lines.push_back(line.str());
+            }
+            for (const auto& rel : prim.GetAuthoredRelationships()) {
+                std::string line(rel.GetPath().GetString());
+                rel.GetTargets(&targets);
+                for (const auto& target : targets) {
+                    line += " -> " + target.GetString();
+                }
+                lines.push_back(line);
+            }
+        }
+        std::sort(lines.begin(), lines.end());
+        return lines;
+    }
+
+    // A request of the concurrent export, a material or a loose node.
+    struct export_request {
+        std::string key;
+        std::string name;
+        AtNode* material;
+        const AtNode* node;
+    };
+
+    // Requests are merged in the order of their material or gathered node
+    // path, then of their name, so the serial export follows that order.
+    std::vector<export_request> make_requests(const options& opts, const concurrent_scene& scene) {
+        std::vector<export_request> requests;
+        for (const auto& material : scene.materials) {
+            requests.push_back(export_request {opts.scope + "/" + material.first, material.first,
+                                               material.second, nullptr});
+        }
+        for (const auto* node : scene.nodes) {
+            std::string clean_name(AiNodeGetName(node));
+            AiShaderExport::clean_arnold_name(clean_name);
+            requests.push_back(export_request {opts.scope + "/" + clean_name, AiNodeGetName(node), nullptr, node});
+        }
+        std::sort(requests.begin(), requests.end(),
+                  [] (const export_request& a, const export_request& b) -> bool {
+                      return a.key < b.key || (a.key == b.key && a.name < b.name);
+                  });
+        return requests;
+    }
+
+    void export_request_with(AiShaderExport& exporter, const export_request& request, const SdfPath& scope) {
+        if (request.material != nullptr) {
+            exporter.export_material(request.name.c_str(), request.material);
+        } else {
+            auto parent_path = scope;
+            exporter.export_arnold_node(request.node, parent_path);
+        }
+    }
+
+    // Exports the scene serially, then runs concurrent exports from
+    // opts.threads threads, each taking the requests in a different order,
+    // and checks every one authors the same stage as the serial export.
+    bool run_concurrent(const options& opts, size_t node_count, AiShaderExport::AuthoringMode mode) {
+        AiBegin();
+        const auto scene = make_concurrent_scene(opts, node_count);
+        const auto requests = make_requests(opts, scene);
+        const SdfPath scope(opts.scope);
+
+        auto serial_stage = UsdStage::CreateInMemory();
+        {
+            AiShaderExport exporter(serial_stage, scope);
+            setup_exporter(exporter, opts, mode);
+            for (const auto& request : requests) {
+                export_request_with(exporter, request, scope);
+            }
+        }
+        const auto expected = dump_stage(serial_stage);
+
+        auto ok = true;
+        std::vector<size_t> order(requests.size());
+        for (auto i = decltype(order.size()){0}; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        for (auto run = 0; run < opts.runs && ok; ++run) {
+            std::mt19937 random(static_cast<std::mt19937::result_type>(run));
+            std::shuffle(order.begin(), order.end(), random);
+            auto stage = UsdStage::CreateInMemory();
+            AiShaderExport exporter(stage, scope);
+            setup_exporter(exporter, opts, mode);
+            const auto t0 = tbb::tick_count::now();
+            exporter.begin_concurrent_export();
+            std::atomic<size_t> next(0);
+            std::vector<std::thread> threads;
+            for (auto i = 0; i < opts.threads; ++i) {
+                threads.emplace_back([&] () {
+                    for (auto j = next++; j < order.size(); j = next++) {
+                        export_request_with(exporter, requests[order[j]], scope);
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            exporter.end_concurrent_export();
+            const auto export_time = (tbb::tick_count::now() - t0).seconds();
+
+            const auto result = dump_stage(stage);
+            const auto compared = std::min(expected.size(), result.size());
+            const auto mismatch = std::mismatch(expected.begin(), expected.begin() + compared, result.begin());
+            ok = expected.size() == result.size() && mismatch.first == expected.end();
+            if (!opts.quiet || !ok) {
+                std::printf("  run %d: export %.3fs, %zu lines, %s\n", run, export_time, result.size(),
+                            ok ? "same as the serial export" : "differs from the serial export");
+            }
+            if (!ok) {
+                std::printf("    serial:     %s\n    concurrent: %s\n",
+                            mismatch.first == expected.end() ? "(end)" : mismatch.first->c_str(),
+                            mismatch.second == result.end() ? "(end)" : mismatch.second->c_str());
+            }
+        }
+        AiEnd();
+        std::printf("%zu nodes in %zu materials and %zu loose nodes, %d threads, %s authoring: %s\n",
+                    scene.node_count, scene.materials.size(), scene.nodes.size(), opts.threads,
+                    get_mode_name(mode), ok ? "deterministic" : "NOT deterministic");
+        return ok;
+    }
+}
+
+int main(int argc, char** argv) {
+    options opts;
+    if (!parse_options(argc, argv, opts)) {
+        print_usage();
+        return 1;
+    }
+    auto ok = true;
+    for (const auto node_count : opts.sizes) {
+        if (opts.threads > 0) {
+            for (const auto mode : opts.authoring_modes) {
+                ok = run_concurrent(opts, node_count, mode) && ok;
+            }
+        } else if (opts.types) {
+            for (const auto mode : opts.authoring_modes) {
+                run_types(opts, node_count, mode);
+            }
+        } else {
+            std::vector<double> export_times;
+            for (const auto mode : opts.authoring_modes) {
+                export_times.push_back(run(opts, node_count, mode));
+            }
+            if (export_times.size() == 2 && export_times[1] > 0.0) {
+                std::printf("  layer authoring is %.2fx the speed of stage authoring\n",
+                            export_times[0] / export_times[1]);
+            }
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -1,9 +1,18 @@
 #include "pxr/usd/usdAi/aiShaderExport.h"
 
+#include "pxr/base/gf/matrix4d.h"
 #include "pxr/base/gf/matrix4f.h"
+#include "pxr/base/tf/diagnostic.h"
+#include "pxr/base/tracelite/trace.h"
+#include "pxr/usd/sdf/attributeSpec.h"
+#include "pxr/usd/sdf/changeBlock.h"
+#include "pxr/usd/sdf/primSpec.h"
+#include "pxr/usd/sdf/relationshipSpec.h"
 #include "pxr/usd/sdf/types.h"
+#include "pxr/usd/usdAi/tokens.h"
 #include "pxr/usd/usdAi/aiMaterialAPI.h"
 #include "pxr/usd/usdAi/aiNodeAPI.h"
+#include "pxr/usd/usd/editTarget.h"
 #include "pxr/usd/usd/relationship.h"
 #include "pxr/usd/usd/primRange.h"
 #include "pxr/usd/usdGeom/scope.h"
@@ -13,6 +22,18 @@
 #include "pxr/usd/usdShade/input.h"
 #include "pxr/usd/usdShade/connectableAPI.h"
 
+#include <boost/functional/hash.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <mutex>
+#include <string>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/spin_rw_mutex.h>
 #include <tbb/tick_count.h>
 
 
@@ -25,10 +46,15 @@ namespace {
         return GfMatrix4f(mat.data);
     };
 
-    inline GfMatrix4f ArrayGetMatrix(const AtArray* arr, uint32_t i, const char* file, uint32_t line) {
-        const auto mat = AiArrayGetMtxFunc(arr, i, file, line);
-        return GfMatrix4f(mat.data);
-    }
+    // Adds the time spent in the scope to a stats field.
+    class scoped_timer {
+    public:
+        explicit scoped_timer(double& seconds) : m_seconds(seconds), m_start(tbb::tick_count::now()) { }
+        ~scoped_timer() { m_seconds += (tbb::tick_count::now() - m_start).seconds(); }
+    private:
+        double& m_seconds;
+        tbb::tick_count m_start;
+    };
 
     inline const char* GetEnum(AtEnum en, int32_t id) {
         if (en == nullptr) { return ""; }
@@ -41,119 +67,252 @@ namespace {
         return en[id];
     }
 
-    template <typename LHT, typename RHT> inline
-    void convert(LHT& l, const RHT& r) {
-        static_assert(sizeof(LHT) == sizeof(RHT), "Input data for convert must has the same size");
-        memcpy(&l, &r, sizeof(r));
+    // Array copy for types where Arnold and USD share the same memory layout.
+    struct same_layout {
+        template <typename T, typename A>
+        static void copy(T* out, const A* in, size_t count) {
+            static_assert(sizeof(T) == sizeof(A), "Input data for copy must have the same size");
+            memcpy(out, in, sizeof(A) * count);
+        }
     };
 
-    template <> inline
-    void convert<std::string, const char*>(std::string& l, const char* const& r) {
-        l = r;
+    // Per AI_TYPE accessors, the dispatch table below is built from these.
+    template <uint8_t AI_T> struct ai_type_traits;
+
+    template <> struct ai_type_traits<AI_TYPE_BYTE> : same_layout {
+        using element_type = uint8_t;
+        using arnold_type = uint8_t;
+        static const SdfValueTypeName& scalar_type() { return SdfValueTypeNames->UChar; }
+        static const SdfValueTypeName& array_type() { return SdfValueTypeNames->UCharArray; }
+        static uint8_t get(const AtNode* no, const char* na) { return AiNodeGetByte(no, na); }
+        static uint8_t get_default(const AtParamValue* pv) { return pv->BYTE(); }
     };
 
-    template <> inline
-    void convert<std::string, AtString>(std::string& l, const AtString& r) {
-        l = r.c_str();
+    template <> struct ai_type_traits<AI_TYPE_INT> : same_layout {
+        using element_type = int32_t;
+        using arnold_type = int32_t;
+        static const SdfValueTypeName& scalar_type() { return SdfValueTypeNames->Int; }
+        static const SdfValueTypeName& array_type() { return SdfValueTypeNames->IntArray; }
+        static int32_t get(const AtNode* no, const char* na) { return AiNodeGetInt(no, na); }
+        static int32_t get_default(const AtParamValue* pv) { return pv->INT(); }
     };
 
-    template <typename T, typename R = T> inline
-    void export_array(UsdShadeInput& param, const AtArray* arr, R (*f) (const AtArray*, uint32_t, const char*, int32_t)) {
-        // we already check the validity of the array before this call
-        const auto nelements = AiArrayGetNumElements(arr);
-        VtArray<T> out_arr(nelements);
-        for (auto i = 0u; i < nelements; ++i) {
-            convert(out_arr[i], f(arr, i, __FILE__, __LINE__));
-        }
-        param.Set(VtValue(out_arr));
-    }
+    template <> struct ai_type_traits<AI_TYPE_UINT> : same_layout {
+        using element_type = uint32_t;
+        using arnold_type = uint32_t;
+        static const SdfValueTypeName& scalar_type() { return SdfValueTypeNames->UInt; }
+        static const SdfValueTypeName& array_type() { return SdfValueTypeNames->UIntArray; }
+        static uint32_t get(const AtNode* no, const char* na) { return AiNodeGetUInt(no, na); }
+        static uint32_t get_default(const AtParamValue* pv) { return pv->UINT(); }
+    };
+
+    template <> struct ai_type_traits<AI_TYPE_BOOLEAN> : same_layout {
+        using element_type = bool;
+        using arnold_type = bool;
+        static const SdfValueTypeName& scalar_type() { return SdfValueTypeNames->Bool; }
+        static const SdfValueTypeName& array_type() { return SdfValueTypeNames->BoolArray; }
+        static bool get(const AtNode* no, const char* na) { return AiNodeGetBool(no, na); }
+        static bool get_default(const AtParamValue* pv) { return pv->BOOL(); }
+    };
+
+    template <> struct ai_type_traits<AI_TYPE_FLOAT> : same_layout {
+        using element_type = float;
+        using arnold_type = float;
+        static const SdfValueTypeName& scalar_type() { return SdfValueTypeNames->Float; }
+        static const SdfValueTypeName& array_type() { return SdfValueTypeNames->FloatArray; }
+        static float get(const AtNode* no, const char* na) { return AiNodeGetFlt(no, na); }
+        static float get_default(const AtParamValue* pv) { return pv->FLT(); }
+    };
+
+    template <> struct ai_type_traits<AI_TYPE_RGB> : same_layout {
+        using element_type = GfVec3f;
+        using arnold_type = AtRGB;
+        static const SdfValueTypeName& scalar_type() { return SdfValueTypeNames->Color3f; }
+        static const SdfValueTypeName& array_type() { return SdfValueTypeNames->Color3fArray; }
+        static GfVec3f convert(const AtRGB& v) { return GfVec3f(v.r, v.g, v.b); }
+        static GfVec3f get(const AtNode* no, const char* na) { return convert(AiNodeGetRGB(no, na)); }
+        static GfVec3f get_default(const AtParamValue* pv) { return convert(pv->RGB()); }
+    };
+
+    template <> struct ai_type_traits<AI_TYPE_RGBA> : same_layout {
+        using element_type = GfVec4f;
+        using arnold_type = AtRGBA;
+        static const SdfValueTypeName& scalar_type() { return SdfValueTypeNames->Color4f; }
+        static const SdfValueTypeName& array_type() { return SdfValueTypeNames->Color4fArray; }
+        static GfVec4f convert(const AtRGBA& v) { return GfVec4f(v.r, v.g, v.b, v.a); }
+        static GfVec4f get(const AtNode* no, const char* na) { return convert(AiNodeGetRGBA(no, na)); }
+        static GfVec4f get_default(const AtParamValue* pv) { return convert(pv->RGBA()); }
+    };
+
+    template <> struct ai_type_traits<AI_TYPE_VECTOR> : same_layout {
+        using element_type = GfVec3f;
+        using arnold_type = AtVector;
+        static const SdfValueTypeName& scalar_type() { return SdfValueTypeNames->Vector3f; }
+        static const SdfValueTypeName& array_type() { return SdfValueTypeNames->Vector3fArray; }
+        static GfVec3f convert(const AtVector& v) { return GfVec3f(v.x, v.y, v.z); }
+        static GfVec3f get(const AtNode* no, const char* na) { return convert(AiNodeGetVec(no, na)); }
+        static GfVec3f get_default(const AtParamValue* pv) { return convert(pv->VEC()); }
+    };
+
+    template <> struct ai_type_traits<AI_TYPE_VECTOR2> : same_layout {
+        using element_type = GfVec2f;
+        using arnold_type = AtVector2;
+        static const SdfValueTypeName& scalar_type() { return SdfValueTypeNames->Float2; }
+        static const SdfValueTypeName& array_type() { return SdfValueTypeNames->Float2Array; }
+        static GfVec2f convert(const AtVector2& v) { return GfVec2f(v.x, v.y); }
+        static GfVec2f get(const AtNode* no, const char* na) { return convert(AiNodeGetVec2(no, na)); }
+        static GfVec2f get_default(const AtParamValue* pv) { return convert(pv->VEC2()); }
+    };
 
-    struct simple_type {
-        const SdfValueTypeName& type;
-        std::function<VtValue(const AtNode*, const char*)> f;
+    template <> struct ai_type_traits<AI_TYPE_STRING> {
+        using element_type = std::string;
+        using arnold_type = AtString;
+        static const SdfValueTypeName& scalar_type() { return SdfValueTypeNames->String; }
+        static const SdfValueTypeName& array_type() { return SdfValueTypeNames->StringArray; }
+        static std::string get(const AtNode* no, const char* na) { return AiNodeGetStr(no, na).c_str(); }
+        static std::string get_default(const AtParamValue* pv) {
+            const auto* str = pv->STR().c_str();
+            return str == nullptr ? "" : str;
+        }
+        static void copy(std::string* out, const AtString* in, size_t count) {
+            for (auto i = decltype(count){0}; i < count; ++i) {
+                const auto* str = in[i].c_str();
+                out[i] = str == nullptr ? "" : str;
+            }
+        }
+    };
 
-        // TODO: see if move works in this case.
-        simple_type(const SdfValueTypeName& _type, std::function<VtValue(const AtNode*, const char*)> _f) :
-            type(_type), f(_f) { }
+    template <> struct ai_type_traits<AI_TYPE_MATRIX> {
+        using element_type = GfMatrix4d;
+        using arnold_type = AtMatrix;
+        static const SdfValueTypeName& scalar_type() { return SdfValueTypeNames->Matrix4d; }
+        static const SdfValueTypeName& array_type() { return SdfValueTypeNames->Matrix4dArray; }
+        static GfMatrix4d get(const AtNode* no, const char* na) { return GfMatrix4d(NodeGetMatrix(no, na)); }
+        static GfMatrix4d get_default(const AtParamValue* pv) { return GfMatrix4d(GfMatrix4f(pv->pMTX()->data)); }
+        // Widening float to double, written as a flat loop so it vectorizes.
+        static void copy(GfMatrix4d* out, const AtMatrix* in, size_t count) {
+            for (auto i = decltype(count){0}; i < count; ++i) {
+                const auto* src = &in[i].data[0][0];
+                auto* dst = out[i].GetArray();
+                for (auto j = 0; j < 16; ++j) {
+                    dst[j] = static_cast<double>(src[j]);
+                }
+            }
+        }
     };
 
-    // TODO: use sorted vectors with lower bound searches. Too many ptr jumps here
-    const std::map<uint8_t, simple_type> simple_type_map = {
-        {AI_TYPE_BYTE, {SdfValueTypeNames->UChar, [](const AtNode* no, const char* na) -> VtValue { return VtValue(AiNodeGetByte(no, na)); }}},
-        {AI_TYPE_INT, {SdfValueTypeNames->Int, [](const AtNode* no, const char* na) -> VtValue { return VtValue(AiNodeGetInt(no, na)); }}},
-        {AI_TYPE_UINT, {SdfValueTypeNames->UInt, [](const AtNode* no, const char* na) -> VtValue { return VtValue(AiNodeGetUInt(no, na)); }}},
-        {AI_TYPE_BOOLEAN, {SdfValueTypeNames->Bool, [](const AtNode* no, const char* na) -> VtValue { return VtValue(AiNodeGetBool(no, na)); }}},
-        {AI_TYPE_FLOAT, {SdfValueTypeNames->Float, [](const AtNode* no, const char* na) -> VtValue { return VtValue(AiNodeGetFlt(no, na)); }}},
-        {AI_TYPE_RGB, {SdfValueTypeNames->Color3f, [](const AtNode* no, const char* na) -> VtValue { const auto v = AiNodeGetRGB(no, na); return VtValue(GfVec3f(v.r, v.g, v.b)); }}},
-        {AI_TYPE_RGBA, {SdfValueTypeNames->Color4f, [](const AtNode* no, const char* na) -> VtValue { const auto v = AiNodeGetRGBA(no, na); return VtValue(GfVec4f(v.r, v.g, v.b, v.a)); }}},
-        {AI_TYPE_VECTOR, {SdfValueTypeNames->Vector3f, [](const AtNode* no, const char* na) -> VtValue { const auto v = AiNodeGetVec(no, na); return VtValue(GfVec3f(v.x, v.y, v.z)); }}},
-        {AI_TYPE_VECTOR2, {SdfValueTypeNames->Float2, [](const AtNode* no, const char* na) -> VtValue { const auto v = AiNodeGetVec2(no, na); return VtValue(GfVec2f(v.x, v.y)); }}},
-        {AI_TYPE_STRING, {SdfValueTypeNames->String, [](const AtNode* no, const char* na) -> VtValue { return VtValue(AiNodeGetStr(no, na).c_str()); }}},
-        {AI_TYPE_NODE, {SdfValueTypeNames->String, nullptr}},
-        {AI_TYPE_CLOSURE, {SdfValueTypeNames->String, nullptr}},
-        {AI_TYPE_MATRIX, {SdfValueTypeNames->Matrix4d, [](const AtNode* no, const char* na) -> VtValue { return VtValue(NodeGetMatrix(no, na)); }}},
-        {AI_TYPE_ENUM, {SdfValueTypeNames->String, [](const AtNode* no, const char* na) -> VtValue {
+    // Enums are exported as their string value, enum arrays as plain ints.
+    template <> struct ai_type_traits<AI_TYPE_ENUM> : same_layout {
+        using element_type = int32_t;
+        using arnold_type = int32_t;
+        static const SdfValueTypeName& scalar_type() { return SdfValueTypeNames->String; }
+        static const SdfValueTypeName& array_type() { return SdfValueTypeNames->IntArray; }
+        static std::string get(const AtNode* no, const char* na) {
             const auto* nentry = AiNodeGetNodeEntry(no);
-            if (nentry == nullptr) { return VtValue(""); }
+            if (nentry == nullptr) { return ""; }
             const auto* pentry = AiNodeEntryLookUpParameter(nentry, na);
-            if (pentry == nullptr) { return VtValue(""); }
-            const auto enums = AiParamGetEnum(pentry);
-            return VtValue(GetEnum(enums, AiNodeGetInt(no, na)));
-        }}},
+            if (pentry == nullptr) { return ""; }
+            return GetEnum(AiParamGetEnum(pentry), AiNodeGetInt(no, na));
+        }
+        static std::string get_default(const AtParamValue*) { return ""; } // see make_param_desc
     };
 
-    const simple_type*
-    get_simple_type(uint8_t type) {
-        const auto it = simple_type_map.find(type);
-        if (it != simple_type_map.end()) {
-            return &it->second;
-        } else {
-            return nullptr;
-        }
+    const SdfValueTypeName& string_type() { return SdfValueTypeNames->String; }
+    const SdfValueTypeName& string_array_type() { return SdfValueTypeNames->StringArray; }
+
+    template <uint8_t AI_T>
+    VtValue get_value(const AtNode* no, const char* na) {
+        return VtValue(ai_type_traits<AI_T>::get(no, na));
+    }
+
+    template <uint8_t AI_T>
+    VtValue get_default(const AtParamValue* pv) {
+        return VtValue(ai_type_traits<AI_T>::get_default(pv));
     }
 
-    struct array_type {
-        const SdfValueTypeName& type;
-        std::function<void(UsdShadeInput&, const AtArray*)> f;
+    // AiArrayMap / AiArrayUnmap modify the array, and the same array is
+    // read by several gather threads when a node is shared between
+    // networks (and for parameter defaults), so mapping is serialized per
+    // array. Striped, so unrelated arrays rarely contend.
+    std::mutex& array_mutex(const AtArray* arr) {
+        constexpr size_t stripe_count = 64;
+        static std::mutex stripes[stripe_count];
+        return stripes[(reinterpret_cast<uintptr_t>(arr) >> 4) % stripe_count];
+    }
+
+    // Maps the array and copies all the motion keys in one go, keys are
+    // stored one after the other, both in Arnold and in the output.
+    template <uint8_t AI_T>
+    VtValue get_array(const AtArray* arr) {
+        using traits = ai_type_traits<AI_T>;
+        // we already check the validity of the array before this call
+        const auto count = static_cast<size_t>(AiArrayGetNumElements(arr)) * AiArrayGetNumKeys(arr);
+        VtArray<typename traits::element_type> out_arr(count);
+        std::lock_guard<std::mutex> lock(array_mutex(arr));
+        auto* mapped_arr = const_cast<AtArray*>(arr);
+        const auto* data = reinterpret_cast<const typename traits::arnold_type*>(AiArrayMap(mapped_arr));
+        if (data != nullptr) {
+            traits::copy(out_arr.data(), data, count);
+        }
+        AiArrayUnmap(mapped_arr);
+        return VtValue(out_arr);
+    }
 
-        array_type(const SdfValueTypeName& _type, std::function<void(UsdShadeInput&, const AtArray*)> _f) :
-            type(_type), f(_f) { }
+    // Shared by the scalar, array and user parameter paths. A null
+    // scalar_type means the type is not exported, a null getter means
+    // the type only carries connections (nodes and closures).
+    struct type_desc {
+        uint8_t ai_type;
+        const SdfValueTypeName& (*scalar_type)();
+        const SdfValueTypeName& (*array_type)();
+        VtValue (*get_value)(const AtNode*, const char*);
+        VtValue (*get_array)(const AtArray*);
+        VtValue (*get_default)(const AtParamValue*);
     };
 
-    const std::map<uint8_t, array_type> array_type_map = {
-        {AI_TYPE_BYTE, {SdfValueTypeNames->UCharArray, [](UsdShadeInput& p, const AtArray* a) { export_array<uint8_t>(p, a, AiArrayGetByteFunc); }}},
-        {AI_TYPE_INT, {SdfValueTypeNames->IntArray, [](UsdShadeInput& p, const AtArray* a) { export_array<int32_t>(p, a, AiArrayGetIntFunc); }}},
-        {AI_TYPE_UINT, {SdfValueTypeNames->UIntArray, [](UsdShadeInput& p, const AtArray* a) { export_array<uint32_t>(p, a, AiArrayGetUIntFunc); }}},
-        {AI_TYPE_BOOLEAN, {SdfValueTypeNames->BoolArray, [](UsdShadeInput& p, const AtArray* a) { export_array<bool>(p, a, AiArrayGetBoolFunc); }}},
-        {AI_TYPE_FLOAT, {SdfValueTypeNames->FloatArray, [](UsdShadeInput& p, const AtArray* a) { export_array<float>(p, a, AiArrayGetFltFunc); }}},
-        {AI_TYPE_RGB, {SdfValueTypeNames->Color3fArray, [](UsdShadeInput& p, const AtArray* a) { export_array<GfVec3f, AtRGB>(p, a, AiArrayGetRGBFunc); }}},
-        {AI_TYPE_RGBA, {SdfValueTypeNames->Color4fArray, [](UsdShadeInput& p, const AtArray* a) { export_array<GfVec4f, AtRGBA>(p, a, AiArrayGetRGBAFunc); }}},
-        {AI_TYPE_VECTOR, {SdfValueTypeNames->Vector3fArray, [](UsdShadeInput& p, const AtArray* a) { export_array<GfVec3f, AtVector>(p, a, AiArrayGetVecFunc); }}},
-        {AI_TYPE_VECTOR2, {SdfValueTypeNames->Float2Array, [](UsdShadeInput& p, const AtArray* a) { export_array<GfVec2f, AtVector2>(p, a, AiArrayGetVec2Func); }}},
-        {AI_TYPE_STRING, {SdfValueTypeNames->StringArray, [](UsdShadeInput& p, const AtArray* a) { export_array<std::string, AtString>(p, a, AiArrayGetStrFunc); }}},
-        {AI_TYPE_NODE, {SdfValueTypeNames->StringArray, nullptr}},
-        {AI_TYPE_CLOSURE, {SdfValueTypeNames->StringArray, nullptr}},
-        {AI_TYPE_MATRIX,
-            {SdfValueTypeNames->Matrix4dArray,
-                           [](UsdShadeInput& p, const AtArray* a) {
-                               const auto nelements = AiArrayGetNumElements(a);
-                               VtArray<GfMatrix4d> arr(nelements);
-                               for (auto i = 0u; i < nelements; ++i) {
-                                   arr[i] = GfMatrix4d(ArrayGetMatrix(a, i, __FILE__, __LINE__));
-                               }
-                           }
-                       }}, // TODO: implement
-        {AI_TYPE_ENUM, {SdfValueTypeNames->IntArray, [](UsdShadeInput& p, const AtArray* a) { export_array<int32_t>(p, a, AiArrayGetIntFunc); }}},
+    template <uint8_t AI_T> constexpr
+    type_desc typed_desc() {
+        return type_desc {AI_T, &ai_type_traits<AI_T>::scalar_type, &ai_type_traits<AI_T>::array_type,
+                          &get_value<AI_T>, &get_array<AI_T>, &get_default<AI_T>};
+    }
+
+    constexpr type_desc reference_desc(uint8_t ai_type) {
+        return type_desc {ai_type, &string_type, &string_array_type, nullptr, nullptr, nullptr};
+    }
+
+    constexpr type_desc unsupported_desc(uint8_t ai_type) {
+        return type_desc {ai_type, nullptr, nullptr, nullptr, nullptr, nullptr};
+    }
+
+    // Indexed directly by AI_TYPE, see the static_assert below.
+    constexpr type_desc type_table[] = {
+        typed_desc<AI_TYPE_BYTE>(),
+        typed_desc<AI_TYPE_INT>(),
+        typed_desc<AI_TYPE_UINT>(),
+        typed_desc<AI_TYPE_BOOLEAN>(),
+        typed_desc<AI_TYPE_FLOAT>(),
+        typed_desc<AI_TYPE_RGB>(),
+        typed_desc<AI_TYPE_RGBA>(),
+        typed_desc<AI_TYPE_VECTOR>(),
+        typed_desc<AI_TYPE_VECTOR2>(),
+        typed_desc<AI_TYPE_STRING>(),
+        unsupported_desc(AI_TYPE_POINTER),
+        reference_desc(AI_TYPE_NODE),
+        unsupported_desc(AI_TYPE_ARRAY),
+        typed_desc<AI_TYPE_MATRIX>(),
+        typed_desc<AI_TYPE_ENUM>(),
+        reference_desc(AI_TYPE_CLOSURE),
     };
+    constexpr size_t type_table_size = sizeof(type_table) / sizeof(type_table[0]);
 
-    const array_type*
-    get_array_type(uint8_t type) {
-        const auto it = array_type_map.find(type);
-        if (it != array_type_map.end()) {
-            return &it->second;
-        } else {
-            return nullptr;
-        }
+    constexpr bool type_table_ordered(size_t i = 0) {
+        return i == type_table_size || (type_table[i].ai_type == i && type_table_ordered(i + 1));
+    }
+    static_assert(type_table_ordered(), "type_table must be indexed by AI_TYPE");
+
+    inline const type_desc*
+    get_type_desc(uint8_t type) {
+        return type < type_table_size && type_table[type].scalar_type != nullptr ? &type_table[type] : nullptr;
     }
 
     struct out_comp_t {
@@ -161,6 +320,7 @@ namespace {
         const SdfValueTypeName& t;
 
         out_comp_t(const char* _n, const SdfValueTypeName& _t) : n(_n), t(_t) { }
+        out_comp_t(const TfToken& _n, const SdfValueTypeName& _t) : n(_n), t(_t) { }
     };
     // Preferring std::vector here over pointers, so we can get some extra
     // boundary checks in debug mode.
@@ -178,8 +338,9 @@ namespace {
             {"z", SdfValueTypeNames->Float},
         };
         if (index == -1) {
-            auto itype = get_simple_type(static_cast<uint8_t>(output_type));
-            return itype == nullptr ? node_comp_name : out_comp_t {"out", itype->type};
+            const static TfToken out_name("out");
+            auto itype = get_type_desc(static_cast<uint8_t>(output_type));
+            return itype == nullptr ? node_comp_name : out_comp_t {out_name, itype->scalar_type()};
         } else {
             if (output_type == AI_TYPE_RGBA || output_type == AI_TYPE_RGB) {
                 return rgba_comp_names[std::min(static_cast<size_t>(index), rgba_comp_names.size() - 1)];
@@ -192,6 +353,21 @@ namespace {
         }
     }
 
+    // Guards the element names cached on the parameter descriptors.
+    tbb::spin_rw_mutex element_descs_mutex;
+
+    // Stored on exported materials to find the ones that changed since the
+    // previous export.
+    const TfToken& fingerprint_key() {
+        const static TfToken key("aiFingerprint");
+        return key;
+    }
+
+    // Connections target outputs:name on the source shader.
+    TfToken output_name(const TfToken& name) {
+        return TfToken(UsdShadeTokens->outputs.GetString() + name.GetString());
+    }
+
     using in_comp_names_t = std::vector<const char*>;
     const in_comp_names_t& in_comp_names(int32_t input_type) {
         const static in_comp_names_t empty;
@@ -225,16 +401,240 @@ AiShaderExport::AiShaderExport(const UsdStagePtr& _stage, const SdfPath& parent_
                                const UsdTimeCode& _time_code) :
     m_stage(_stage),
     m_shaders_scope(parent_scope.IsEmpty() ? SdfPath("/Looks") : parent_scope),
-    m_time_code(_time_code)
+    m_time_code(_time_code),
+    m_nodes_gathered(0),
+    m_inputs_elided(0),
+    m_arrays_copied(0),
+    m_array_bytes_copied(0),
+    m_entry_cache_hits(0),
+    m_entry_cache_misses(0),
+    m_authoring_mode(AUTHORING_MODE_STAGE),
+    m_deduplicate_nodes(false),
+    m_sparse(false),
+    m_incremental(false),
+    m_sampling(false),
+    m_concurrent(false)
 {
     auto scope = UsdGeomScope::Define(m_stage, m_shaders_scope);
 }
 
+void AiShaderExport::set_shared_scope(const std::string& scope_name) {
+    if (scope_name.empty()) {
+        m_shared_scope = SdfPath();
+        return;
+    }
+    m_shared_scope = m_shaders_scope.AppendChild(TfToken(scope_name));
+    UsdGeomScope::Define(m_stage, m_shared_scope);
+}
+
+// Makes a valid prim name, characters that are not allowed are replaced
+// and names starting with a digit are prefixed.
 void AiShaderExport::clean_arnold_name(std::string& name) {
-    std::replace(name.begin(), name.end(), '@', '_');
-    std::replace(name.begin(), name.end(), '.', '_');
-    std::replace(name.begin(), name.end(), '|', '_');
-    std::replace(name.begin(), name.end(), ':', '_');
+    if (name.empty()) {
+        name = "_";
+        return;
+    }
+    for (auto& c : name) {
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_')) {
+            c = '_';
+        }
+    }
+    if (name[0] >= '0' && name[0] <= '9') {
+        name.insert(name.begin(), '_');
+    }
+}
+
+// Names that clean up to the same prim name are made unique by a suffix.
+// Names taken in the network being gathered are checked here, the ones
+// taken by other networks gathered at the same time when merging. Suffixes
+// are tried from the first one not registered yet, so each collision only
+// probes the paths gathered but not merged. Expects m_path_owners_mutex.
+SdfPath
+AiShaderExport::get_unique_path(const SdfPath& parent_path, const std::string& name,
+                                const path_owners* network_owners) {
+    std::string clean_name(name);
+    clean_arnold_name(clean_name);
+    const auto base_path = parent_path.AppendChild(TfToken(clean_name));
+    const auto collisions = m_collisions.find(base_path);
+    if (collisions != m_collisions.end()) {
+        const auto it = collisions->second.paths.find(name);
+        if (it != collisions->second.paths.end()) {
+            return it->second;
+        }
+    }
+    auto is_taken = [&] (const SdfPath& candidate) -> bool {
+        if (network_owners != nullptr) {
+            const auto it = network_owners->find(candidate);
+            if (it != network_owners->end() && it->second != name) {
+                return true;
+            }
+        }
+        const auto it = m_path_owners.find(candidate);
+        return it != m_path_owners.end() && it->second != name;
+    };
+    if (!is_taken(base_path)) {
+        return base_path;
+    }
+    auto i = collisions == m_collisions.end() ? size_t{1} : collisions->second.next_suffix;
+    auto path = parent_path.AppendChild(TfToken(clean_name + "_" + std::to_string(i)));
+    while (is_taken(path)) {
+        path = parent_path.AppendChild(TfToken(clean_name + "_" + std::to_string(++i)));
+    }
+    return path;
+}
+
+// Returns true if the path has a suffix, because the clean name was taken
+// by another name. Expects m_path_owners_mutex.
+bool
+AiShaderExport::register_path(const SdfPath& path, const std::string& name) {
+    m_path_owners.insert(std::make_pair(path, name));
+    std::string clean_name(name);
+    clean_arnold_name(clean_name);
+    const auto& path_name = path.GetName();
+    if (path_name == clean_name) {
+        return false;
+    }
+    auto& collisions = m_collisions[path.GetParentPath().AppendChild(TfToken(clean_name))];
+    collisions.paths.insert(std::make_pair(name, path));
+    const auto suffix = std::strtoul(path_name.c_str() + clean_name.size() + 1, nullptr, 10);
+    collisions.next_suffix = std::max(collisions.next_suffix, static_cast<size_t>(suffix) + 1);
+    return true;
+}
+
+AiShaderExport::param_desc
+AiShaderExport::make_param_desc(const AtNodeEntry* nentry, const AtParamEntry* pentry) {
+    param_desc param;
+    param.name = AiParamGetName(pentry);
+    param.token = TfToken(param.name.c_str());
+    param.type = static_cast<uint8_t>(AiParamGetType(pentry));
+    const auto iter_type = get_type_desc(param.type);
+    if (iter_type != nullptr) {
+        param.usd_type = iter_type->scalar_type();
+    }
+    if (param.type == AI_TYPE_ENUM) {
+        const auto enums = AiParamGetEnum(pentry);
+        for (auto i = 0; enums != nullptr && enums[i] != nullptr; ++i) {
+            param.enum_tokens.push_back(TfToken(enums[i]));
+        }
+    }
+    for (const auto& comp : in_comp_names(param.type)) {
+        param.components.push_back({
+            std::string(param.name.c_str()) + "." + comp,
+            TfToken(param.token.GetString() + ":" + comp)});
+    }
+    // Stored the same way as the exported values, so they can be compared
+    // directly when authoring sparsely.
+    const auto* default_value = AiParamGetDefault(pentry);
+    if (default_value != nullptr) {
+        if (param.type == AI_TYPE_ENUM) {
+            const auto id = default_value->INT();
+            if (id >= 0 && static_cast<size_t>(id) < param.enum_tokens.size()) {
+                param.default_value = VtValue(param.enum_tokens[id].GetString());
+            }
+        } else if (param.type == AI_TYPE_ARRAY) {
+            const auto* arr = default_value->ARRAY();
+            if (arr != nullptr && AiArrayGetNumElements(arr) > 0 && AiArrayGetNumKeys(arr) > 0) {
+                const auto array_type = get_type_desc(static_cast<uint8_t>(AiArrayGetType(arr)));
+                if (array_type != nullptr && array_type->get_array != nullptr) {
+                    param.default_value = array_type->get_array(arr);
+                }
+            }
+        } else if (iter_type != nullptr && iter_type->get_default != nullptr) {
+            param.default_value = iter_type->get_default(default_value);
+        }
+    }
+    // Only input parameters explicitly flagged as not linkable are skipped.
+    static const AtString linkable_str("linkable");
+    bool linkable = true;
+    param.linkable = !AiMetaDataGetBool(nentry, param.name, linkable_str, &linkable) || linkable;
+    return param;
+}
+
+const AiShaderExport::component_desc&
+AiShaderExport::get_element_desc(const param_desc& param, uint32_t index) {
+    auto& elements = param.elements;
+    tbb::spin_rw_mutex::scoped_lock lock(element_descs_mutex, false);
+    if (elements.size() > index) {
+        return elements[index];
+    }
+    lock.upgrade_to_writer();
+    while (elements.size() <= index) {
+        const auto i = elements.size();
+        std::stringstream ss1; ss1 << param.name.c_str() << "[" << i << "]";
+        std::stringstream ss2; ss2 << param.token.GetString() << ":i" << i;
+        elements.push_back({ss1.str(), TfToken(ss2.str())});
+    }
+    return elements[index];
+}
+
+void
+AiShaderExport::probe_links(const AtNode* arnold_node, const param_desc& param, param_links& links) {
+    links.linked = false;
+    links.elements.clear();
+    if (!param.linkable) {
+        return;
+    }
+    if (param.type == AI_TYPE_ARRAY) {
+        // The whole array is linked when any of its elements is, so arrays
+        // nothing is linked to cost one lookup whatever their length.
+        if (!AiNodeIsLinked(arnold_node, param.name.c_str())) {
+            return;
+        }
+        const auto arr = AiNodeGetArray(arnold_node, param.name);
+        if (arr == nullptr) {
+            return;
+        }
+        const auto num_elements = AiArrayGetNumElements(arr);
+        for (auto i = decltype(num_elements){0}; i < num_elements; ++i) {
+            if (AiNodeIsLinked(arnold_node, get_element_desc(param, i).arnold_name.c_str())) {
+                links.elements.push_back(i);
+            }
+        }
+    } else if (param.type != AI_TYPE_NODE) {
+        // This also returns true if only some of the components are linked.
+        links.linked = AiNodeIsLinked(arnold_node, param.name.c_str());
+    }
+}
+
+void
+AiShaderExport::build_link_index(const AtNode* arnold_node, const entry_desc& entry, link_index& links) {
+    links.resize(entry.params.size());
+    // Only shaders can have their inputs linked.
+    for (auto i = decltype(links.size()){0}; i < links.size(); ++i) {
+        if (entry.linkable) {
+            probe_links(arnold_node, entry.params[i], links[i]);
+        } else {
+            links[i].linked = false;
+            links[i].elements.clear();
+        }
+    }
+}
+
+const AiShaderExport::entry_desc&
+AiShaderExport::get_entry_desc(const AtNodeEntry* nentry) {
+    // References to the descriptors stay valid when the map grows.
+    std::lock_guard<std::mutex> lock(m_entry_descs_mutex);
+    const auto it = m_entry_descs.find(nentry);
+    if (it != m_entry_descs.end()) {
+        ++m_entry_cache_hits;
+        return it->second;
+    }
+    ++m_entry_cache_misses;
+    auto& entry = m_entry_descs[nentry];
+    entry.id = TfToken(AiNodeEntryGetName(nentry));
+    entry.linkable = AiNodeEntryGetType(nentry) == AI_NODE_SHADER;
+    entry.params.reserve(static_cast<size_t>(AiNodeEntryGetNumParams(nentry)));
+    static const AtString name_str("name");
+    auto piter = AiNodeEntryGetParamIterator(nentry);
+    while (!AiParamIteratorFinished(piter)) {
+        const auto pentry = AiParamIteratorGetNext(piter);
+        if (AiParamGetName(pentry) == name_str) {
+            continue;
+        }
+        entry.params.push_back(make_param_desc(nentry, pentry));
+    }
+    AiParamIteratorDestroy(piter);
+    return entry;
 }
 
 bool
@@ -254,56 +654,40 @@ AiShaderExport::get_output(const AtNode* src_arnold_node, UsdAiShader& src_shade
     return true;
 }
 
+std::vector<AiShaderExport::component_desc>
+AiShaderExport::make_components(const std::string& usd_name, const std::string& arnold_name, uint8_t type) {
+    std::vector<component_desc> components;
+    for (const auto& comp : in_comp_names(type)) {
+        components.push_back({arnold_name + "." + comp, TfToken(usd_name + ":" + comp)});
+    }
+    return components;
+}
+
+size_t
+AiShaderExport::add_node(const AtNode* arnold_node, const SdfPath& path, const TfToken& id,
+                         exported_network& network) {
+    network.nodes.push_back(exported_node {arnold_node, path, id, {}, false});
+    return network.nodes.size() - 1;
+}
+
 bool
 AiShaderExport::export_connection(const AtNode* dest_arnold_node, UsdAiShader& dest_shader,
                                   const std::string& dest_param_name, const std::string& dest_param_arnold_name,
                                   uint8_t arnold_param_type) {
-    const auto iter_type = get_simple_type(arnold_param_type);
-    if (iter_type == nullptr) {
-        return true; // No need to do anything else
-    }
-    auto _get_output_parameter = [this, dest_arnold_node, arnold_param_type] (const char* param_name, UsdShadeOutput& out) -> bool {
-        int32_t comp = -1;
-        const auto src_arnold_node = arnold_param_type == AI_TYPE_NODE ?
-            reinterpret_cast<AtNode*>(AiNodeGetPtr(dest_arnold_node, param_name)) :
-            AiNodeGetLink(dest_arnold_node, param_name, &comp);
-        if (src_arnold_node != nullptr) {
-            const auto src_path = export_arnold_node(src_arnold_node, m_shaders_scope);
-            auto src_shader = UsdAiShader::Get(m_stage, src_path);
-            // FIXME: check for invalid src_shader
-            return this->get_output(src_arnold_node, src_shader, out, arnold_param_type == AI_TYPE_NODE, comp);
-        } else {
-            return false;
-        }
-    };
-
-    const auto& comp_names = in_comp_names(arnold_param_type);
-    const auto comp_count = comp_names.size();
-    size_t link_count = 0;
-    UsdShadeConnectableAPI connectable_API(dest_shader);
-    UsdShadeOutput source_param;
-    if (_get_output_parameter(dest_param_arnold_name.c_str(), source_param)) {
-        UsdShadeConnectableAPI::ConnectToSource(dest_shader.CreateInput(TfToken(dest_param_name), iter_type->type), source_param);
-        link_count = comp_count;
-    }
-
-    for (const auto& comp : comp_names) {
-        std::stringstream ss1; ss1 << dest_param_arnold_name << "." << comp;
-        const auto& arnold_comp_name = ss1.str();        
-        if (_get_output_parameter(arnold_comp_name.c_str(), source_param)) {
-            std::stringstream ss2; ss2 << dest_param_name << ":" << comp;
-            const auto& usd_comp_name = ss2.str();
-            auto param_comp = connectable_API.CreateInput(TfToken(usd_comp_name),
-                                                          SdfValueTypeNames->Float);
-            if (param_comp) {
-                connectable_API.ConnectToSource(param_comp, source_param);
-                ++link_count;
-            }
-        }
+    TRACE_FUNCTION();
+    exported_network network;
+    auto ret = false;
+    {
+        scoped_timer timer(m_stats.gather_time);
+        const auto node_index = add_node(dest_arnold_node, dest_shader.GetPath(), TfToken(), network);
+        ret = gather_connection(dest_arnold_node, TfToken(dest_param_name), dest_param_arnold_name.c_str(),
+                                arnold_param_type,
+                                make_components(dest_param_name, dest_param_arnold_name, arnold_param_type),
+                                node_index, network);
+        process_worklist(network);
     }
-
-    // If we return true, then all the values are filled out
-    return link_count >= comp_count;
+    merge_and_author(network);
+    return ret;
 }
 
 
@@ -324,7 +708,7 @@ AiShaderExport::export_connection(const AtNode* dest_arnold_node, UsdAiShader& d
                                   const char* dest_param_name,
                                   const AtNode* src_arnold_node, UsdAiShader& src_shader,
                                   int32_t src_comp_index) {
-    // const auto iter_type = get_simple_type(arnold_param_type);
+    // const auto iter_type = get_type_desc(arnold_param_type);
     // if (iter_type == nullptr) {
     //     return false;
     // }
@@ -333,74 +717,117 @@ AiShaderExport::export_connection(const AtNode* dest_arnold_node, UsdAiShader& d
     get_output(src_arnold_node, src_shader, out, false, src_comp_index);
 
     // we could assume the dest has the same type as source_param
-    UsdShadeConnectableAPI::ConnectToSource(
-        dest_shader.CreateInput(TfToken(dest_param_name), out.GetTypeName()), out);
+    dest_shader.CreateInput(TfToken(dest_param_name), out.GetTypeName()).GetAttr().SetConnections(
+        SdfPathVector {out.GetAttr().GetPath()});
     return true;
 }
 
 void
 AiShaderExport::export_parameter(
     const AtNode* arnold_node, UsdAiShader& shader, const char* arnold_param_name, uint8_t arnold_param_type, bool user) {
-    if (arnold_param_type == AI_TYPE_ARRAY) {
-        const auto arr = AiNodeGetArray(arnold_node, arnold_param_name);
-        const auto array_element_type = AiArrayGetType(arr);
-        if (arr == nullptr) {
-            return;
-        }
-        const auto num_elements = AiArrayGetNumElements(arr);
-        if (num_elements == 0 ||
-            AiArrayGetNumKeys(arr) == 0 ||
-            array_element_type == AI_TYPE_ARRAY) {
-            return;
-        }
-        const auto iter_type = get_array_type(array_element_type);
-        if (iter_type == nullptr) {
-            return;
-        }
-        auto param = shader.CreateInput(TfToken(arnold_param_name), iter_type->type);
-        if (iter_type->f != nullptr) {
-            iter_type->f(param, arr);
-
-            // We have to check for connections per element
-            for (auto i = decltype(num_elements){0}; i < num_elements; ++i) {
-                std::stringstream ss1;
-                ss1 << arnold_param_name << "[" << i << "]";
-                const auto& element_name = ss1.str();
-                if (AiNodeIsLinked(arnold_node, element_name.c_str())) {
-                    std::stringstream ss2;
-                    ss2 << arnold_param_name << ":i" << i;
-                    export_connection(arnold_node, shader, ss2.str().c_str(), element_name.c_str(), array_element_type);
-                }
-            }
-        }
-    } else {
+    TRACE_FUNCTION();
+    exported_network network;
+    {
+        scoped_timer timer(m_stats.gather_time);
+        const auto node_index = add_node(arnold_node, shader.GetPath(), TfToken(), network);
         if (user) {
-            const auto iter_type = get_simple_type(arnold_param_type);
-            if (iter_type == nullptr) {
-                return;
-            }
-            UsdAiNodeAPI api(shader.GetPrim());
-            auto param = api.CreateUserAttribute(TfToken(arnold_param_name), iter_type->type);
-            param.Set(iter_type->f(arnold_node, arnold_param_name));
+            gather_user_parameter(arnold_node, arnold_param_name, arnold_param_type, node_index, network);
         } else {
-            // FIXME: Are we doing the right thin in case of AI_TYPE_NODE?
-            if (!AiNodeIsLinked(arnold_node, arnold_param_name) || 
-                !export_connection(arnold_node, shader, arnold_param_name, arnold_param_name, arnold_param_type)) {                
-                const auto iter_type = get_simple_type(arnold_param_type);
-                // Note: iter_type for AI_TYPE_NODE is {String, nullptr}
-                if (iter_type == nullptr  || iter_type->f == nullptr) {
-                    return;
-                }
-                auto param = shader.CreateInput(TfToken(arnold_param_name), iter_type->type);
-                param.Set(iter_type->f(arnold_node, arnold_param_name));
+            const auto nentry = AiNodeGetNodeEntry(arnold_node);
+            const auto pentry = AiNodeEntryLookUpParameter(nentry, arnold_param_name);
+            if (pentry == nullptr) {
+                return;
             }
+            const auto param = make_param_desc(nentry, pentry);
+            param_links links;
+            probe_links(arnold_node, param, links);
+            gather_parameter(arnold_node, param, links, node_index, network);
         }
+        process_worklist(network);
     }
+    merge_and_author(network);
 }
 
 SdfPath
 AiShaderExport::export_arnold_node(const AtNode* arnold_node, SdfPath& parent_path,
                                    const std::set<std::string>* exportable_params) {
+    TRACE_FUNCTION();
+    exported_network network;
+    SdfPath shader_path;
+    if (m_concurrent) {
+        // Identical nodes are only replaced when the networks are merged.
+        shader_path = gather_node(arnold_node, parent_path, exportable_params, network);
+        if (!shader_path.IsEmpty()) {
+            m_staged_networks.local().push_back(
+                staged_network {shader_path, AiNodeGetName(arnold_node), std::move(network)});
+        }
+        return shader_path;
+    }
+    {
+        scoped_timer timer(m_stats.gather_time);
+        shader_path = gather_node(arnold_node, parent_path, exportable_params, network);
+    }
+    merge_and_author(network);
+    if (shader_path.IsEmpty()) {
+        return shader_path;
+    }
+    // The node might have been replaced by an identical one.
+    return m_shader_to_usd_path[arnold_node];
+}
+
+std::vector<SdfPath>
+AiShaderExport::export_arnold_nodes(const std::vector<const AtNode*>& arnold_nodes, const SdfPath& parent_path,
+                                    const std::set<std::string>* exportable_params) {
+    TRACE_FUNCTION();
+    std::vector<SdfPath> shader_paths;
+    shader_paths.reserve(arnold_nodes.size());
+    if (m_concurrent) {
+        for (const auto* arnold_node : arnold_nodes) {
+            auto node_parent_path = parent_path;
+            shader_paths.push_back(export_arnold_node(arnold_node, node_parent_path, exportable_params));
+        }
+        return shader_paths;
+    }
+
+    std::vector<exported_network> networks(arnold_nodes.size());
+    {
+        TRACE_SCOPE("AiShaderExport gather");
+        scoped_timer timer(m_stats.gather_time);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, arnold_nodes.size()),
+            [&] (const tbb::blocked_range<size_t>& range) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    gather_node(arnold_nodes[i], parent_path, exportable_params, networks[i]);
+                }
+            });
+    }
+    exported_network merged;
+    {
+        scoped_timer timer(m_stats.merge_time);
+        for (auto& network : networks) {
+            merge_network(network, merged);
+        }
+    }
+    author(merged);
+    for (const auto* arnold_node : arnold_nodes) {
+        const auto it = m_shader_to_usd_path.find(arnold_node);
+        shader_paths.push_back(it == m_shader_to_usd_path.end() ? SdfPath() : it->second);
+    }
+    return shader_paths;
+}
+
+SdfPath
+AiShaderExport::gather_node(const AtNode* arnold_node, const SdfPath& parent_path,
+                            const std::set<std::string>* exportable_params, exported_network& network) {
+    const auto shader_path = add_to_worklist(arnold_node, parent_path, exportable_params, network);
+    process_worklist(network);
+    return shader_path;
+}
+
+// Only names the node and queues it, its parameters are gathered by
+// process_worklist, so deep networks don't recurse.
+SdfPath
+AiShaderExport::add_to_worklist(const AtNode* arnold_node, const SdfPath& parent_path,
+                                const std::set<std::string>* exportable_params, exported_network& network) {
     if (arnold_node == nullptr) {
         return SdfPath();
     }
@@ -413,156 +840,1416 @@ AiShaderExport::export_arnold_node(const AtNode* arnold_node, SdfPath& parent_pa
     if (it != m_shader_to_usd_path.end()) {
         return it->second;
     }
+    const auto nit = network.node_paths.find(arnold_node);
+    if (nit != network.node_paths.end()) {
+        return nit->second;
+    }
     std::string node_name(AiNodeGetName(arnold_node));
     if (node_name.empty()) {
         // TODO: raise error
         return SdfPath();
     }
     // MtoA exports sub shaders with @ prefix, which is used for something else in USD
-    // TODO: implement a proper cleanup using boost::regex
-    clean_arnold_name(node_name);
-    auto shader_path = parent_path.AppendPath(SdfPath(node_name));
-    auto shader = UsdAiShader::Define(m_stage, shader_path);
-    m_shader_to_usd_path.insert(std::make_pair(arnold_node, shader_path));
-
-    shader.CreateIdAttr(VtValue(TfToken(AiNodeEntryGetName(nentry))));
-    auto piter = AiNodeEntryGetParamIterator(nentry);
-    while (!AiParamIteratorFinished(piter)) {
-        const auto pentry = AiParamIteratorGetNext(piter);
-        auto pname = AiParamGetName(pentry);
-
-        if (strcmp(pname, "name") == 0) {
-            continue;
-        }
-        if (exportable_params != nullptr &&
-            exportable_params->find(pname.c_str()) == exportable_params->end()) {
-            continue;
-        }
-        const auto ptype = static_cast<uint8_t>(AiParamGetType(pentry));
-        export_parameter(arnold_node, shader, pname, ptype, false);
+    SdfPath shader_path;
+    {
+        std::lock_guard<std::mutex> lock(m_path_owners_mutex);
+        shader_path = get_unique_path(parent_path, node_name, &network.path_owners);
     }
-    AiParamIteratorDestroy(piter);
-    auto puiter = AiNodeGetUserParamIterator(arnold_node);
-    while (!AiUserParamIteratorFinished(puiter)) {
-        const auto pentry = AiUserParamIteratorGetNext(puiter);
-        auto pname = AiUserParamGetName(pentry);
-        const auto ptype = static_cast<uint8_t>(AiUserParamGetType(pentry));
-        export_parameter(arnold_node, shader, pname, ptype, true);
-    }
-    AiUserParamIteratorDestroy(puiter);
+    network.path_owners.insert(std::make_pair(shader_path, node_name));
+    network.node_paths.insert(std::make_pair(arnold_node, shader_path));
+    ++m_nodes_gathered;
+
+    const auto& entry = get_entry_desc(nentry);
+    const auto node_index = add_node(arnold_node, shader_path, entry.id, network);
+    network.pending.push_back(pending_node {node_index, &entry, exportable_params});
     return shader_path;
 }
 
-void AiShaderExport::bind_material(const SdfPath& material_path, const SdfPath& shape_path) {
-
-    auto shape_prim = m_stage->GetPrimAtPath(shape_path);
-    if (!shape_prim.IsValid()) {
-        return;
-    }
-    // FIXME: why not use UsdShadeMaterial::Get(m_stage, material_path).Bind(shape_prim) ???
-    auto material_prim = m_stage->GetPrimAtPath(material_path);
-    if (!material_prim.IsValid()) {
-        return;
-    }
-
-    if (shape_prim.HasRelationship(UsdShadeTokens->materialBinding)) {
-        auto rel = shape_prim.GetRelationship(UsdShadeTokens->materialBinding);
-        rel.ClearTargets(true);
-        rel.AddTarget(material_path);
-    } else {
-        auto rel = shape_prim.CreateRelationship(UsdShadeTokens->materialBinding);
-        rel.AddTarget(material_path);
+void
+AiShaderExport::process_worklist(exported_network& network) {
+    TRACE_FUNCTION();
+    std::vector<pending_node> batch;
+    link_index links;
+    while (!network.pending.empty()) {
+        // Nodes found while gathering a batch go to the next one. Nodes of
+        // the same type are gathered together, so they read the same
+        // descriptors. Sorting by name keeps the naming order deterministic.
+        batch.clear();
+        std::swap(batch, network.pending);
+        std::stable_sort(batch.begin(), batch.end(), [] (const pending_node& a, const pending_node& b) {
+            return a.entry != b.entry && a.entry->id < b.entry->id;
+        });
+        for (const auto& pending : batch) {
+            const auto arnold_node = network.nodes[pending.index].arnold_node;
+            const auto& entry = *pending.entry;
+            links.clear();
+            build_link_index(arnold_node, entry, links);
+            for (auto i = decltype(entry.params.size()){0}; i < entry.params.size(); ++i) {
+                const auto& param = entry.params[i];
+                if (pending.exportable_params != nullptr &&
+                    pending.exportable_params->find(param.token.GetString()) == pending.exportable_params->end()) {
+                    continue;
+                }
+                gather_parameter(arnold_node, param, links[i], pending.index, network);
+            }
+            auto puiter = AiNodeGetUserParamIterator(arnold_node);
+            while (!AiUserParamIteratorFinished(puiter)) {
+                const auto pentry = AiUserParamIteratorGetNext(puiter);
+                auto pname = AiUserParamGetName(pentry);
+                const auto ptype = static_cast<uint8_t>(AiUserParamGetType(pentry));
+                gather_user_parameter(arnold_node, pname, ptype, pending.index, network);
+            }
+            AiUserParamIteratorDestroy(puiter);
+        }
     }
+    sort_network(network);
 }
 
-SdfPath
-AiShaderExport::export_material(const char* material_name, AtNode* surf_shader, AtNode* disp_shader) {
-    auto material_path = m_shaders_scope.AppendChild(TfToken(material_name));
-    auto material_prim = m_stage->GetPrimAtPath(material_path);
-    if (material_prim.IsValid()) {
-        // already exists and setup
-        return material_path;
+// Orders the nodes so each comes after the nodes connected to it, Kahn's
+// algorithm. Nodes that can't be ordered are part of, or downstream of a
+// cycle, they are flagged and moved to the end.
+void
+AiShaderExport::sort_network(exported_network& network) {
+    const auto node_count = network.nodes.size();
+    std::unordered_map<SdfPath, size_t, SdfPath::Hash> indices;
+    for (auto i = decltype(node_count){0}; i < node_count; ++i) {
+        indices.insert(std::make_pair(network.nodes[i].path, i));
     }
-    auto material = UsdAiMaterialAPI(UsdShadeMaterial::Define(m_stage, material_path));
-
-    if (surf_shader != nullptr) {
-        auto surf_path = export_arnold_node(surf_shader, material_path);
-        if (!surf_path.IsEmpty()) {
-            auto rel = material.CreateSurfaceRel();
-            rel.AddTarget(surf_path);
+    std::vector<std::vector<size_t>> downstream(node_count);
+    std::vector<size_t> upstream_count(node_count, 0);
+    std::set<size_t> sources;
+    for (auto i = decltype(node_count){0}; i < node_count; ++i) {
+        sources.clear();
+        for (const auto& input : network.nodes[i].inputs) {
+            if (input.source.IsEmpty()) {
+                continue;
+            }
+            const auto it = indices.find(input.source);
+            if (it != indices.end()) {
+                sources.insert(it->second);
+            }
         }
-    }
-
-    if (disp_shader != nullptr) {
-        // FIXME: it's unclear why disp uses m_shaders_scope and surf uses material_path...
-        auto disp_path = export_arnold_node(disp_shader, m_shaders_scope);
-        if (!disp_path.IsEmpty()) {
-            auto rel = material.CreateDisplacementRel();
-            rel.AddTarget(disp_path);
+        for (const auto source : sources) {
+            downstream[source].push_back(i);
         }
-    }
-    return material_path;
-}
-
-void _collapse_shaders(UsdPrim prim) {
-    if (!prim.IsA<UsdGeomXform>()) {
-        return;
+        upstream_count[i] = sources.size();
     }
 
-    auto children = prim.GetAllChildren();
-    if (children.empty()) {
-        return;
+    std::vector<size_t> order;
+    order.reserve(node_count);
+    for (auto i = decltype(node_count){0}; i < node_count; ++i) {
+        if (upstream_count[i] == 0) {
+            order.push_back(i);
+        }
     }
-    SdfPathVector materials;
-    bool first = true;
-    for (auto child : children) {
-        _collapse_shaders(child);
-        if (child.HasRelationship(UsdShadeTokens->materialBinding)) {
-            if (first) {
-                child.GetRelationship(UsdShadeTokens->materialBinding).GetTargets(&materials);
-                first = false;
-            } else {
-                SdfPathVector test_materials;
-                child.GetRelationship(UsdShadeTokens->materialBinding).GetTargets(&test_materials);
-                if (materials != test_materials) {
-                    materials.clear();
-                    break;
-                }
+    for (auto head = decltype(order.size()){0}; head < order.size(); ++head) {
+        for (const auto i : downstream[order[head]]) {
+            if (--upstream_count[i] == 0) {
+                order.push_back(i);
             }
-        } else {
-            materials.clear();
-            break;
         }
     }
-
-    if (!materials.empty()) {
-        for (auto child : children) {
-            if (child.HasRelationship(UsdShadeTokens->materialBinding)) {
-                child.RemoveProperty(UsdShadeTokens->materialBinding);
+    if (order.size() < node_count) {
+        // Every network reaching the cycle runs into it, the nodes are only
+        // reported the first time.
+        std::string names;
+        std::lock_guard<std::mutex> lock(m_cyclic_nodes_mutex);
+        for (auto i = decltype(node_count){0}; i < node_count; ++i) {
+            if (upstream_count[i] == 0) {
+                continue;
+            }
+            auto& node = network.nodes[i];
+            node.cyclic = true;
+            order.push_back(i);
+            if (!m_cyclic_nodes.insert(node.arnold_node).second) {
+                continue;
             }
+            if (!names.empty()) {
+                names += ", ";
+            }
+            names += node.path.GetString();
         }
-        prim.CreateRelationship(UsdShadeTokens->materialBinding).SetTargets(materials);
-    }
-}
-
-void AiShaderExport::collapse_shaders() { 
-    tbb::tick_count tc = tbb::tick_count::now();
-    auto prim_range = m_stage->Traverse();
-    for (auto stage_iter = prim_range.begin(); stage_iter != prim_range.end(); ++stage_iter) {
-        if (stage_iter.IsPostVisit()) {
-            continue;
+        if (!names.empty()) {
+            TF_WARN("Cycle in the shader network, these nodes are exported without reordering: %s",
+                    names.c_str());
         }
+    }
 
-        // shaders and instances are in a scope, everything else is simple hierarchy
-        // with mostly shader assignments
-        if (!stage_iter->IsA<UsdGeomScope>()) {
-            _collapse_shaders(*stage_iter);
-        }
-        stage_iter.PruneChildren();
+    std::vector<exported_node> nodes;
+    nodes.reserve(node_count);
+    for (const auto i : order) {
+        nodes.push_back(std::move(network.nodes[i]));
     }
-    std::cerr << "[usdAi] Collapsing shader assignments took: "
-              << (tbb::tick_count::now() - tc).seconds() << std::endl;
+    std::swap(nodes, network.nodes);
 }
 
+void
+AiShaderExport::gather_parameter(const AtNode* arnold_node, const param_desc& param, const param_links& links,
+                                 size_t node_index, exported_network& network) {
+    exported_input input {param.token, param.usd_type, VtValue(), 1, false, SdfPath(), TfToken()};
+    if (param.type == AI_TYPE_ARRAY) {
+        // The whole array is linked when any of its elements is, so arrays
+        // nothing is linked to cost one lookup whatever their length.
+        if (!AiNodeIsLinked(arnold_node, param.name.c_str())) {
+            return;
+        }
+        const auto arr = AiNodeGetArray(arnold_node, param.name);
+        if (arr == nullptr) {
+            return;
+        }
+        const auto array_element_type = AiArrayGetType(arr);
+        const auto num_elements = AiArrayGetNumElements(arr);
+        if (num_elements == 0 ||
+            AiArrayGetNumKeys(arr) == 0 ||
+            array_element_type == AI_TYPE_ARRAY) {
+            return;
+        }
+        const auto iter_type = get_type_desc(array_element_type);
+        if (iter_type == nullptr) {
+            return;
+        }
+        input.type = iter_type->array_type();
+        if (iter_type->get_array == nullptr) {
+            network.nodes[node_index].inputs.push_back(input);
+            return;
+        }
+        input.value = iter_type->get_array(arr);
+        // Motion keys are stored one after the other in the same array.
+        input.motion_keys = static_cast<int>(AiArrayGetNumKeys(arr));
+        ++m_arrays_copied;
+        m_array_bytes_copied += static_cast<size_t>(AiArrayGetKeySize(arr)) * AiArrayGetNumKeys(arr);
+        // Connected elements are authored next to the array, so it's kept.
+        if (m_sparse && !m_sampling && links.elements.empty() && input.value == param.default_value) {
+            ++m_inputs_elided;
+        } else {
+            network.nodes[node_index].inputs.push_back(input);
+        }
+
+        for (const auto i : links.elements) {
+            if (i >= num_elements) {
+                continue;
+            }
+            const auto& element = get_element_desc(param, i);
+            gather_connection(arnold_node, element.usd_name, element.arnold_name.c_str(), array_element_type,
+                              make_components(element.usd_name.GetString(), element.arnold_name, array_element_type),
+                              node_index, network);
+        }
+    } else {
+        // FIXME: Are we doing the right thin in case of AI_TYPE_NODE?
+        if (links.linked &&
+            gather_connection(arnold_node, param.token, param.name.c_str(), param.type, param.components,
+                              node_index, network)) {
+            return;
+        }
+        if (param.type == AI_TYPE_ENUM) {
+            const auto id = AiNodeGetInt(arnold_node, param.name);
+            input.value = id >= 0 && static_cast<size_t>(id) < param.enum_tokens.size() ?
+                          VtValue(param.enum_tokens[id].GetString()) : VtValue(std::string());
+        } else {
+            const auto iter_type = get_type_desc(param.type);
+            // Note: get_value for AI_TYPE_NODE is nullptr
+            if (iter_type == nullptr  || iter_type->get_value == nullptr) {
+                return;
+            }
+            input.value = iter_type->get_value(arnold_node, param.name.c_str());
+        }
+        if (m_sparse && !m_sampling && input.value == param.default_value) {
+            ++m_inputs_elided;
+            return;
+        }
+        network.nodes[node_index].inputs.push_back(input);
+    }
+}
+
+void
+AiShaderExport::gather_user_parameter(const AtNode* arnold_node, const char* arnold_param_name,
+                                      uint8_t arnold_param_type, size_t node_index, exported_network& network) {
+    if (arnold_param_type == AI_TYPE_ARRAY) {
+        // User arrays are exported as inputs, same as regular arrays.
+        param_desc param;
+        param.name = AtString(arnold_param_name);
+        param.token = TfToken(arnold_param_name);
+        param.type = arnold_param_type;
+        param.linkable = true;
+        param_links links;
+        probe_links(arnold_node, param, links);
+        gather_parameter(arnold_node, param, links, node_index, network);
+        return;
+    }
+    const auto iter_type = get_type_desc(arnold_param_type);
+    if (iter_type == nullptr || iter_type->get_value == nullptr) {
+        return;
+    }
+    network.nodes[node_index].inputs.push_back(exported_input {
+        TfToken(arnold_param_name), iter_type->scalar_type(),
+        iter_type->get_value(arnold_node, arnold_param_name), 1, true, SdfPath(), TfToken()});
+}
+
+bool
+AiShaderExport::gather_connection(const AtNode* dest_arnold_node, const TfToken& dest_param_name,
+                                  const char* dest_param_arnold_name, uint8_t arnold_param_type,
+                                  const std::vector<component_desc>& components,
+                                  size_t node_index, exported_network& network) {
+    const auto iter_type = get_type_desc(arnold_param_type);
+    if (iter_type == nullptr) {
+        return true; // No need to do anything else
+    }
+    const auto is_node_type = arnold_param_type == AI_TYPE_NODE;
+    auto _get_source = [&] (const char* param_name, SdfPath& source, TfToken& output) -> bool {
+        int32_t comp = -1;
+        const auto src_arnold_node = is_node_type ?
+            reinterpret_cast<AtNode*>(AiNodeGetPtr(dest_arnold_node, param_name)) :
+            AiNodeGetLink(dest_arnold_node, param_name, &comp);
+        if (src_arnold_node == nullptr) {
+            return false;
+        }
+        source = add_to_worklist(src_arnold_node, m_shared_scope.IsEmpty() ? m_shaders_scope : m_shared_scope,
+                                 nullptr, network);
+        if (source.IsEmpty()) {
+            return false;
+        }
+        const auto linked_output_type = is_node_type ?
+                                        AI_TYPE_NODE :
+                                        AiNodeEntryGetOutputType(AiNodeGetNodeEntry(src_arnold_node));
+        const auto& out_comp = out_comp_name(linked_output_type, comp);
+        network.outputs.push_back(exported_output {source, out_comp.n, out_comp.t});
+        output = out_comp.n;
+        return true;
+    };
+
+    SdfPath source;
+    TfToken output;
+    if (_get_source(dest_param_arnold_name, source, output)) {
+        // Linking the whole parameter overrides the component links.
+        network.nodes[node_index].inputs.push_back(exported_input {
+            dest_param_name, iter_type->scalar_type(), VtValue(), 1, false, source, output});
+        return true;
+    }
+
+    size_t link_count = 0;
+    for (const auto& comp : components) {
+        if (_get_source(comp.arnold_name.c_str(), source, output)) {
+            network.nodes[node_index].inputs.push_back(exported_input {
+                comp.usd_name, SdfValueTypeNames->Float, VtValue(), 1, false, source, output});
+            ++link_count;
+        }
+    }
+
+    // If we return true, then all the values are filled out
+    return link_count >= components.size();
+}
+
+void
+AiShaderExport::author(const exported_network& network) {
+    TRACE_FUNCTION();
+    scoped_timer timer(m_stats.author_time);
+    for (const auto& node : network.nodes) {
+        m_stats.inputs_authored += node.inputs.size();
+        for (const auto& input : node.inputs) {
+            if (!input.source.IsEmpty()) {
+                ++m_stats.connections_authored;
+            }
+        }
+    }
+    if (m_authoring_mode == AUTHORING_MODE_LAYER) {
+        author_layer(network);
+    } else {
+        author_stage(network);
+    }
+}
+
+void
+AiShaderExport::author_stage(const exported_network& network) {
+    TRACE_FUNCTION();
+    for (const auto& material : network.materials) {
+        auto material_api = UsdAiMaterialAPI(UsdShadeMaterial::Define(m_stage, material.path));
+        if (!material.surface.IsEmpty()) {
+            material_api.CreateSurfaceRel().AddTarget(material.surface);
+        }
+        if (!material.displacement.IsEmpty()) {
+            material_api.CreateDisplacementRel().AddTarget(material.displacement);
+        }
+        if (material.fingerprint != 0) {
+            material_api.GetPrim().SetCustomDataByKey(fingerprint_key(), VtValue(material.fingerprint));
+        }
+    }
+
+    for (const auto& node : network.nodes) {
+        auto shader = UsdAiShader::Define(m_stage, node.path);
+        if (!node.id.IsEmpty()) {
+            shader.CreateIdAttr(VtValue(node.id));
+        }
+    }
+
+    // Outputs have to exist before anything is connected to them.
+    for (const auto& output : network.outputs) {
+        UsdShadeConnectableAPI connectable_API(m_stage->GetPrimAtPath(output.node));
+        if (!connectable_API.GetOutput(output.name)) {
+            connectable_API.CreateOutput(output.name, output.type);
+        }
+    }
+
+    const static TfToken motion_keys("motionKeys");
+    for (const auto& node : network.nodes) {
+        UsdAiShader shader(m_stage->GetPrimAtPath(node.path));
+        for (const auto& input : node.inputs) {
+            if (input.user) {
+                UsdAiNodeAPI api(shader.GetPrim());
+                auto attr = api.CreateUserAttribute(input.name, input.type);
+                if (input.samples.empty()) {
+                    attr.Set(input.value);
+                }
+                for (const auto& sample : input.samples) {
+                    attr.Set(sample.second, UsdTimeCode(sample.first));
+                }
+                continue;
+            }
+            auto param = shader.CreateInput(input.name, input.type);
+            if (input.samples.empty() && !input.value.IsEmpty()) {
+                param.Set(input.value);
+            }
+            for (const auto& sample : input.samples) {
+                param.Set(sample.second, UsdTimeCode(sample.first));
+            }
+            if (input.motion_keys > 1) {
+                param.GetAttr().SetCustomDataByKey(motion_keys, VtValue(input.motion_keys));
+            }
+            if (!input.source.IsEmpty()) {
+                // Connections are always authored on the attribute, whatever
+                // encoding UsdShade is configured to write.
+                param.GetAttr().SetConnections(SdfPathVector {
+                    input.source.AppendProperty(output_name(input.source_output))});
+            }
+        }
+    }
+}
+
+void
+AiShaderExport::author_layer(const exported_network& network) {
+    TRACE_FUNCTION();
+    const auto& edit_target = m_stage->GetEditTarget();
+    const auto layer = edit_target.GetLayer();
+    if (!layer) {
+        return;
+    }
+    const static TfToken material_type("Material");
+    const static TfToken shader_type("AiShader");
+    const static std::string motion_keys("motionKeys");
+
+    // Network paths are stage paths, specs are authored at the paths
+    // mapped through the edit target, like UsdStage::DefinePrim does.
+    auto map_path = [&edit_target] (const SdfPath& path) -> SdfPath {
+        return edit_target.MapToSpecPath(path);
+    };
+    auto define_prim = [&layer, &map_path] (const SdfPath& path, const TfToken& type) -> SdfPrimSpecHandle {
+        const auto spec_path = map_path(path);
+        if (spec_path.IsEmpty()) {
+            return SdfPrimSpecHandle();
+        }
+        auto prim = SdfCreatePrimInLayer(layer, spec_path);
+        if (prim) {
+            prim->SetSpecifier(SdfSpecifierDef);
+            prim->SetTypeName(type.GetString());
+        }
+        return prim;
+    };
+    auto get_attribute = [&layer] (const SdfPrimSpecHandle& prim, const TfToken& name,
+                                   const SdfValueTypeName& type, bool custom,
+                                   SdfVariability variability) -> SdfAttributeSpecHandle {
+        auto attr = layer->GetAttributeAtPath(prim->GetPath().AppendProperty(name));
+        if (!attr) {
+            attr = SdfAttributeSpec::New(prim, name.GetString(), type, variability, custom);
+        }
+        return attr;
+    };
+    auto set_target = [&layer, &map_path] (const SdfPrimSpecHandle& prim, const TfToken& name,
+                                           const SdfPath& target) {
+        const auto spec_target = map_path(target);
+        if (spec_target.IsEmpty()) {
+            return;
+        }
+        auto rel = layer->GetRelationshipAtPath(prim->GetPath().AppendProperty(name));
+        if (!rel) {
+            rel = SdfRelationshipSpec::New(prim, name.GetString(), false);
+        }
+        if (rel) {
+            rel->GetTargetPathList().ClearEditsAndMakeExplicit();
+            rel->GetTargetPathList().Add(spec_target);
+        }
+    };
+    auto input_name = [] (const exported_input& input) -> TfToken {
+        return TfToken((input.user ? UsdAiTokens->userPrefix : UsdShadeTokens->inputs).GetString() +
+                       input.name.GetString());
+    };
+
+    SdfChangeBlock change_block;
+    for (const auto& material : network.materials) {
+        auto prim = define_prim(material.path, material_type);
+        if (!prim) {
+            continue;
+        }
+        if (!material.surface.IsEmpty()) {
+            set_target(prim, UsdAiTokens->aiSurface, material.surface);
+        }
+        if (!material.displacement.IsEmpty()) {
+            set_target(prim, UsdAiTokens->aiDisplacement, material.displacement);
+        }
+        if (material.fingerprint != 0) {
+            prim->SetCustomData(fingerprint_key().GetString(), VtValue(material.fingerprint));
+        }
+    }
+
+    for (const auto& node : network.nodes) {
+        auto prim = define_prim(node.path, shader_type);
+        if (prim && !node.id.IsEmpty()) {
+            get_attribute(prim, UsdShadeTokens->infoId, SdfValueTypeNames->Token, false,
+                          SdfVariabilityUniform)->SetDefaultValue(VtValue(node.id));
+        }
+    }
+
+    for (const auto& output : network.outputs) {
+        auto prim = layer->GetPrimAtPath(map_path(output.node));
+        if (prim) {
+            get_attribute(prim, output_name(output.name), output.type, false, SdfVariabilityVarying);
+        }
+    }
+
+    for (const auto& node : network.nodes) {
+        auto prim = layer->GetPrimAtPath(map_path(node.path));
+        if (!prim) {
+            continue;
+        }
+        for (const auto& input : node.inputs) {
+            auto attr = get_attribute(prim, input_name(input), input.type, input.user, SdfVariabilityVarying);
+            if (!attr) {
+                continue;
+            }
+            if (input.samples.empty() && !input.value.IsEmpty()) {
+                attr->SetDefaultValue(input.value);
+            }
+            for (const auto& sample : input.samples) {
+                layer->SetTimeSample(attr->GetPath(), sample.first, sample.second);
+            }
+            if (input.motion_keys > 1) {
+                attr->SetCustomData(motion_keys, VtValue(input.motion_keys));
+            }
+            if (!input.source.IsEmpty()) {
+                const auto source = map_path(input.source.AppendProperty(output_name(input.source_output)));
+                attr->GetConnectionPathList().ClearEditsAndMakeExplicit();
+                if (!source.IsEmpty()) {
+                    attr->GetConnectionPathList().Add(source);
+                }
+            }
+        }
+    }
+}
+
+void AiShaderExport::bind_material(const SdfPath& material_path, const SdfPath& shape_path) {
+    // FIXME: why not use UsdShadeMaterial::Get(m_stage, material_path).Bind(shape_prim) ???
+    bind_materials(std::vector<std::pair<SdfPath, SdfPath>> {std::make_pair(material_path, shape_path)});
+}
+
+SdfPath
+AiShaderExport::get_material_path(const char* material_name) {
+    std::lock_guard<std::mutex> lock(m_path_owners_mutex);
+    const auto it = m_material_paths.find(material_name);
+    if (it != m_material_paths.end()) {
+        return it->second;
+    }
+    const auto material_path = get_unique_path(m_shaders_scope, material_name, nullptr);
+    m_material_paths.insert(std::make_pair(material_name, material_path));
+    if (register_path(material_path, material_name)) {
+        m_renamed.push_back(std::make_pair(material_name, material_path));
+    }
+    return material_path;
+}
+
+void
+AiShaderExport::gather_material(const SdfPath& material_path, AtNode* surf_shader, AtNode* disp_shader,
+                                exported_network& network) {
+    exported_material material {material_path, SdfPath(), SdfPath(), 0};
+    if (surf_shader != nullptr) {
+        material.surface = gather_node(surf_shader, material_path, nullptr, network);
+    }
+
+    if (disp_shader != nullptr) {
+        // FIXME: it's unclear why disp uses m_shaders_scope and surf uses material_path...
+        material.displacement = gather_node(disp_shader, m_shaders_scope, nullptr, network);
+    }
+    network.materials.push_back(material);
+}
+
+size_t
+AiShaderExport::hash_node(const exported_node& node) {
+    size_t hash = node.id.Hash();
+    for (const auto& input : node.inputs) {
+        boost::hash_combine(hash, input.name.Hash());
+        boost::hash_combine(hash, input.type.GetAsToken().Hash());
+        boost::hash_combine(hash, input.value.GetHash());
+        boost::hash_combine(hash, input.motion_keys);
+        boost::hash_combine(hash, input.user);
+        boost::hash_combine(hash, SdfPath::Hash()(input.source));
+        boost::hash_combine(hash, input.source_output.Hash());
+    }
+    return hash;
+}
+
+bool
+AiShaderExport::same_inputs(const std::vector<exported_input>& a, const std::vector<exported_input>& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (auto i = decltype(a.size()){0}; i < a.size(); ++i) {
+        const auto& ia = a[i];
+        const auto& ib = b[i];
+        if (ia.name != ib.name || ia.type != ib.type || ia.motion_keys != ib.motion_keys ||
+            ia.user != ib.user || ia.source != ib.source || ia.source_output != ib.source_output ||
+            ia.value != ib.value) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Networks gathered in parallel can contain the same nodes, this keeps the
+// first occurrence in merge order and points every reference to it, which
+// is what a serial export would have produced.
+void
+AiShaderExport::merge_network(exported_network& source, exported_network& target) {
+    TRACE_FUNCTION();
+    std::unordered_map<SdfPath, SdfPath, SdfPath::Hash> remapped;
+    // Connections refer to the paths the nodes were gathered at.
+    std::unordered_map<SdfPath, size_t, SdfPath::Hash> kept;
+    std::vector<SdfPath> gathered_paths(source.nodes.size());
+    std::vector<bool> keep(source.nodes.size(), false);
+    std::vector<bool> inputs_remapped(source.nodes.size(), false);
+    for (auto i = decltype(source.nodes.size()){0}; i < source.nodes.size(); ++i) {
+        auto& node = source.nodes[i];
+        gathered_paths[i] = node.path;
+        if (node.id.IsEmpty()) {
+            // Inputs added to an existing shader.
+            keep[i] = true;
+            continue;
+        }
+        const auto it = m_shader_to_usd_path.find(node.arnold_node);
+        if (it == m_shader_to_usd_path.end()) {
+            const std::string node_name(AiNodeGetName(node.arnold_node));
+            std::lock_guard<std::mutex> lock(m_path_owners_mutex);
+            const auto owner = m_path_owners.find(node.path);
+            if (owner != m_path_owners.end() && owner->second != node_name) {
+                // Taken by a network merged before this one.
+                node.path = get_unique_path(node.path.GetParentPath(), node_name, nullptr);
+                remapped[gathered_paths[i]] = node.path;
+            }
+            if (register_path(node.path, node_name)) {
+                m_renamed.push_back(std::make_pair(node_name, node.path));
+            }
+            m_shader_to_usd_path.insert(std::make_pair(node.arnold_node, node.path));
+            kept.insert(std::make_pair(gathered_paths[i], i));
+            keep[i] = true;
+        } else if (it->second != node.path) {
+            remapped.insert(std::make_pair(node.path, it->second));
+        }
+    }
+
+    auto remap = [&remapped] (SdfPath& path) {
+        const auto it = remapped.find(path);
+        if (it != remapped.end()) {
+            path = it->second;
+        }
+    };
+
+    if (m_deduplicate_nodes) {
+        // Networks are sorted upstream first, so identical subgraphs end up
+        // with their connections pointing to the same prims and a node only
+        // has to be compared against the ones already shared.
+        for (auto i = decltype(source.nodes.size()){0}; i < source.nodes.size(); ++i) {
+            if (kept.find(gathered_paths[i]) == kept.end()) {
+                continue;
+            }
+            auto& node = source.nodes[i];
+            inputs_remapped[i] = true;
+            for (auto& input : node.inputs) {
+                remap(input.source);
+            }
+            if (node.cyclic) {
+                continue;
+            }
+            const auto hash = hash_node(node);
+            const auto range = m_shared_nodes.equal_range(hash);
+            auto shared = false;
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second.id == node.id && same_inputs(it->second.inputs, node.inputs)) {
+                    remapped[gathered_paths[i]] = it->second.path;
+                    m_shader_to_usd_path[node.arnold_node] = it->second.path;
+                    keep[i] = false;
+                    shared = true;
+                    ++m_stats.nodes_deduplicated;
+                    break;
+                }
+            }
+            if (!shared) {
+                m_shared_nodes.insert(std::make_pair(hash, shared_node {node.path, node.id, node.inputs}));
+            }
+        }
+    }
+
+    for (auto& material : source.materials) {
+        remap(material.surface);
+        remap(material.displacement);
+        target.materials.push_back(std::move(material));
+    }
+    for (auto i = decltype(source.nodes.size()){0}; i < source.nodes.size(); ++i) {
+        if (!keep[i]) {
+            continue;
+        }
+        auto& node = source.nodes[i];
+        if (!inputs_remapped[i]) {
+            for (auto& input : node.inputs) {
+                remap(input.source);
+            }
+        }
+        target.nodes.push_back(std::move(node));
+    }
+    for (auto& output : source.outputs) {
+        remap(output.node);
+        target.outputs.push_back(std::move(output));
+    }
+}
+
+void
+AiShaderExport::merge_and_author(exported_network& network) {
+    exported_network merged;
+    {
+        scoped_timer timer(m_stats.merge_time);
+        merge_network(network, merged);
+    }
+    author(merged);
+}
+
+// Token and path hashes are not stable across sessions, so the fingerprint
+// hashes their text instead.
+uint64_t
+AiShaderExport::fingerprint_network(const exported_network& network) const {
+    boost::hash<std::string> hash_string;
+    size_t hash = m_sparse ? 1 : 0;
+    for (const auto& material : network.materials) {
+        boost::hash_combine(hash, hash_string(material.surface.GetString()));
+        boost::hash_combine(hash, hash_string(material.displacement.GetString()));
+    }
+    for (const auto& node : network.nodes) {
+        boost::hash_combine(hash, hash_string(node.path.GetString()));
+        boost::hash_combine(hash, hash_string(node.id.GetString()));
+        for (const auto& input : node.inputs) {
+            boost::hash_combine(hash, hash_string(input.name.GetString()));
+            boost::hash_combine(hash, hash_string(input.type.GetAsToken().GetString()));
+            boost::hash_combine(hash, input.value.GetHash());
+            boost::hash_combine(hash, input.motion_keys);
+            boost::hash_combine(hash, input.user);
+            boost::hash_combine(hash, hash_string(input.source.GetString()));
+            boost::hash_combine(hash, hash_string(input.source_output.GetString()));
+            for (const auto& sample : input.samples) {
+                boost::hash_combine(hash, sample.first);
+                boost::hash_combine(hash, sample.second.GetHash());
+            }
+        }
+    }
+    for (const auto& output : network.outputs) {
+        boost::hash_combine(hash, hash_string(output.node.GetString()));
+        boost::hash_combine(hash, hash_string(output.name.GetString()));
+    }
+    // 0 is used for materials without a fingerprint.
+    return hash == 0 ? 1 : static_cast<uint64_t>(hash);
+}
+
+// Fingerprints are taken after merging, so they cover the renamed and
+// deduplicated paths that are actually authored: a material sharing the
+// nodes of another one changes as soon as the sharing stops.
+void
+AiShaderExport::set_fingerprint(exported_network& network) const {
+    if (!network.materials.empty()) {
+        network.materials.front().fingerprint = fingerprint_network(network);
+    }
+}
+
+bool
+AiShaderExport::is_unchanged(const exported_material& material) {
+    m_exported_materials.insert(material.path);
+    const auto prim = m_stage->GetPrimAtPath(material.path);
+    if (!prim.IsValid()) {
+        return false;
+    }
+    const auto fingerprint = prim.GetCustomDataByKey(fingerprint_key());
+    if (fingerprint.IsHolding<uint64_t>() && fingerprint.UncheckedGet<uint64_t>() == material.fingerprint) {
+        ++m_stats.materials_unchanged;
+        return true;
+    }
+    return false;
+}
+
+// Prims of changed networks are authored from scratch, so values and
+// connections that are not exported anymore don't linger.
+void
+AiShaderExport::remove_stale_prims(const exported_network& network) {
+    for (const auto& material : network.materials) {
+        if (m_stage->GetPrimAtPath(material.path).IsValid()) {
+            m_stage->RemovePrim(material.path);
+        }
+    }
+    for (const auto& node : network.nodes) {
+        if (!node.id.IsEmpty() && m_stage->GetPrimAtPath(node.path).IsValid()) {
+            m_stage->RemovePrim(node.path);
+        }
+    }
+}
+
+void
+AiShaderExport::remove_orphaned() {
+    TRACE_FUNCTION();
+    std::set<SdfPath> used_nodes;
+    for (const auto& each : m_shader_to_usd_path) {
+        used_nodes.insert(each.second);
+    }
+    SdfPathVector orphaned;
+    auto find_orphaned = [&] (const SdfPath& scope_path) {
+        const auto scope = m_stage->GetPrimAtPath(scope_path);
+        if (!scope.IsValid()) {
+            return;
+        }
+        for (const auto& child : scope.GetChildren()) {
+            if (child.IsA<UsdShadeMaterial>()) {
+                if (m_exported_materials.find(child.GetPath()) == m_exported_materials.end()) {
+                    orphaned.push_back(child.GetPath());
+                }
+            } else if (child.IsA<UsdAiShader>()) {
+                if (used_nodes.find(child.GetPath()) == used_nodes.end()) {
+                    orphaned.push_back(child.GetPath());
+                }
+            }
+        }
+    };
+    find_orphaned(m_shaders_scope);
+    if (!m_shared_scope.IsEmpty()) {
+        find_orphaned(m_shared_scope);
+    }
+    for (const auto& path : orphaned) {
+        m_stage->RemovePrim(path);
+    }
+    m_stats.prims_orphaned += orphaned.size();
+}
+
+void
+AiShaderExport::begin_time_samples() {
+    m_sampling = true;
+    m_sampled_frames.clear();
+    m_sampled_bindings.clear();
+}
+
+AiShaderExport::sampled_frame&
+AiShaderExport::get_sampled_frame() {
+    for (auto& frame : m_sampled_frames) {
+        if (frame.time == m_time_code) {
+            return frame;
+        }
+    }
+    m_sampled_frames.push_back(sampled_frame {m_time_code, {}, {}});
+    return m_sampled_frames.back();
+}
+
+// The networks of the first time a material was exported at are authored,
+// and their values are replaced by the samples of the inputs that are not
+// the same at every time.
+void
+AiShaderExport::end_time_samples() {
+    TRACE_FUNCTION();
+    if (!m_sampling) {
+        return;
+    }
+    m_sampling = false;
+    std::sort(m_sampled_frames.begin(), m_sampled_frames.end(),
+              [] (const sampled_frame& a, const sampled_frame& b) -> bool { return a.time < b.time; });
+
+    // Inputs are keyed by the material and the path their node was
+    // gathered at, paths are only made unique when merging, so different
+    // nodes can be gathered at the same path for different materials.
+    using node_key = std::pair<SdfPath, SdfPath>;
+    using input_key = std::pair<node_key, TfToken>;
+    std::map<input_key, std::vector<std::pair<double, VtValue>>> samples;
+    for (const auto& frame : m_sampled_frames) {
+        if (frame.time.IsDefault()) {
+            continue;
+        }
+        for (const auto& network : frame.networks) {
+            const auto& material_path = network.materials.front().path;
+            for (const auto& node : network.nodes) {
+                for (const auto& input : node.inputs) {
+                    if (!input.source.IsEmpty()) {
+                        continue;
+                    }
+                    auto& input_samples = samples[input_key(node_key(material_path, node.path), input.name)];
+                    if (input_samples.empty() || input_samples.back().first != frame.time.GetValue()) {
+                        input_samples.push_back(std::make_pair(frame.time.GetValue(), input.value));
+                    }
+                }
+            }
+        }
+    }
+
+    // Nodes identical at one time might not be at others.
+    const auto deduplicate_nodes = m_deduplicate_nodes;
+    m_deduplicate_nodes = false;
+    // Materials are merged separately, so each can be compared against the
+    // stage in incremental mode, like in author_networks.
+    std::vector<exported_network> merged_networks;
+    std::set<SdfPath> merged_materials;
+    // Authored path to the node the samples were collected for. Nodes
+    // shared between materials are in several networks, the first one wins.
+    std::unordered_map<SdfPath, node_key, SdfPath::Hash> sampled_nodes;
+    {
+        scoped_timer timer(m_stats.merge_time);
+        std::vector<std::pair<const AtNode*, SdfPath>> gathered;
+        for (auto& frame : m_sampled_frames) {
+            for (auto& network : frame.networks) {
+                const auto material_path = network.materials.front().path;
+                if (!merged_materials.insert(material_path).second) {
+                    continue;
+                }
+                gathered.clear();
+                for (const auto& node : network.nodes) {
+                    gathered.push_back(std::make_pair(node.id.IsEmpty() ? nullptr : node.arnold_node, node.path));
+                }
+                merged_networks.emplace_back();
+                merge_network(network, merged_networks.back());
+                for (const auto& each : gathered) {
+                    if (each.first == nullptr) {
+                        sampled_nodes.insert(std::make_pair(each.second, node_key(material_path, each.second)));
+                        continue;
+                    }
+                    const auto it = m_shader_to_usd_path.find(each.first);
+                    if (it != m_shader_to_usd_path.end()) {
+                        sampled_nodes.insert(std::make_pair(it->second, node_key(material_path, each.second)));
+                    }
+                }
+            }
+        }
+    }
+    m_deduplicate_nodes = deduplicate_nodes;
+    m_sampled_frames.clear();
+
+    std::set<SdfPath> merged_nodes;
+    exported_network merged;
+    for (auto& network : merged_networks) {
+        std::vector<exported_node> nodes;
+        for (auto& node : network.nodes) {
+            // Arnold nodes recreated between times end up at the same path.
+            if (!node.id.IsEmpty() && !merged_nodes.insert(node.path).second) {
+                continue;
+            }
+            const auto sampled_node = sampled_nodes.find(node.path);
+            if (sampled_node == sampled_nodes.end()) {
+                nodes.push_back(std::move(node));
+                continue;
+            }
+            for (auto& input : node.inputs) {
+                if (!input.source.IsEmpty()) {
+                    continue;
+                }
+                const auto it = samples.find(input_key(sampled_node->second, input.name));
+                if (it == samples.end()) {
+                    continue;
+                }
+                const auto& input_samples = it->second;
+                const auto varying = std::any_of(input_samples.begin(), input_samples.end(),
+                    [&input_samples] (const std::pair<double, VtValue>& sample) -> bool {
+                        return sample.second != input_samples.front().second;
+                    });
+                if (varying) {
+                    input.samples = input_samples;
+                    ++m_stats.inputs_sampled;
+                } else {
+                    input.value = input_samples.front().second;
+                }
+            }
+            nodes.push_back(std::move(node));
+        }
+        network.nodes.swap(nodes);
+        // The fingerprint covers the samples, so it's taken once they are set.
+        if (m_incremental) {
+            set_fingerprint(network);
+            if (!network.materials.empty() && is_unchanged(network.materials.front())) {
+                continue;
+            }
+        }
+        std::move(network.materials.begin(), network.materials.end(), std::back_inserter(merged.materials));
+        std::move(network.nodes.begin(), network.nodes.end(), std::back_inserter(merged.nodes));
+        std::move(network.outputs.begin(), network.outputs.end(), std::back_inserter(merged.outputs));
+    }
+    if (m_incremental) {
+        remove_stale_prims(merged);
+    }
+    author(merged);
+
+    // The materials only exist now, so the bindings made while sampling
+    // are applied after authoring.
+    std::vector<std::pair<std::vector<std::pair<SdfPath, SdfPath>>, bool>> sampled_bindings;
+    sampled_bindings.swap(m_sampled_bindings);
+    for (const auto& each : sampled_bindings) {
+        bind_materials(each.first, each.second);
+    }
+}
+
+SdfPath
+AiShaderExport::export_material(const char* material_name, AtNode* surf_shader, AtNode* disp_shader) {
+    auto material_path = get_material_path(material_name);
+    auto material_prim = m_stage->GetPrimAtPath(material_path);
+    if (material_prim.IsValid() && !m_incremental) {
+        // already exists and setup
+        return material_path;
+    }
+
+    TRACE_FUNCTION();
+    exported_network network;
+    if (m_concurrent) {
+        if (m_concurrent_materials.insert(material_path).second) {
+            gather_material(material_path, surf_shader, disp_shader, network);
+            m_staged_networks.local().push_back(
+                staged_network {material_path, material_name, std::move(network)});
+        }
+        return material_path;
+    }
+    if (m_sampling) {
+        auto& frame = get_sampled_frame();
+        if (frame.materials.insert(material_path).second) {
+            scoped_timer timer(m_stats.gather_time);
+            gather_material(material_path, surf_shader, disp_shader, network);
+            frame.networks.push_back(std::move(network));
+        }
+        return material_path;
+    }
+    {
+        scoped_timer timer(m_stats.gather_time);
+        gather_material(material_path, surf_shader, disp_shader, network);
+    }
+    if (m_incremental) {
+        exported_network merged;
+        {
+            scoped_timer timer(m_stats.merge_time);
+            merge_network(network, merged);
+        }
+        set_fingerprint(merged);
+        if (!is_unchanged(merged.materials.front())) {
+            remove_stale_prims(merged);
+            author(merged);
+        }
+    } else {
+        merge_and_author(network);
+    }
+    return material_path;
+}
+
+std::vector<SdfPath>
+AiShaderExport::export_materials(const std::vector<material_desc>& materials) {
+    TRACE_FUNCTION();
+    std::vector<SdfPath> material_paths;
+    material_paths.reserve(materials.size());
+    // Materials that already exist, or are requested more than once, are
+    // only exported the first time. In incremental mode existing materials
+    // are exported again and only authored if they changed.
+    std::vector<size_t> exported;
+    std::set<SdfPath> requested;
+    for (auto i = decltype(materials.size()){0}; i < materials.size(); ++i) {
+        material_paths.push_back(get_material_path(materials[i].name.c_str()));
+        const auto& material_path = material_paths.back();
+        if (requested.insert(material_path).second &&
+            (m_incremental || !m_stage->GetPrimAtPath(material_path).IsValid()) &&
+            (!m_sampling || get_sampled_frame().materials.insert(material_path).second)) {
+            exported.push_back(i);
+        }
+    }
+
+    // Only Arnold is read here, m_shader_to_usd_path is not modified until
+    // the networks are merged.
+    std::vector<exported_network> networks(exported.size());
+    {
+        TRACE_SCOPE("AiShaderExport gather");
+        scoped_timer timer(m_stats.gather_time);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, exported.size(), 1),
+            [&] (const tbb::blocked_range<size_t>& range) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    const auto& material = materials[exported[i]];
+                    gather_material(material_paths[exported[i]], material.surf_shader,
+                                    material.disp_shader, networks[i]);
+                }
+            });
+    }
+
+    if (m_sampling) {
+        auto& frame = get_sampled_frame();
+        std::move(networks.begin(), networks.end(), std::back_inserter(frame.networks));
+        return material_paths;
+    }
+
+    author_networks(networks);
+    return material_paths;
+}
+
+void
+AiShaderExport::author_networks(std::vector<exported_network>& networks) {
+    exported_network network;
+    {
+        scoped_timer timer(m_stats.merge_time);
+        for (auto& each : networks) {
+            if (!m_incremental) {
+                merge_network(each, network);
+                continue;
+            }
+            // Unchanged networks are still merged, so their nodes are known
+            // to the networks exported after them.
+            exported_network merged;
+            merge_network(each, merged);
+            set_fingerprint(merged);
+            if (!merged.materials.empty() && is_unchanged(merged.materials.front())) {
+                continue;
+            }
+            std::move(merged.materials.begin(), merged.materials.end(), std::back_inserter(network.materials));
+            std::move(merged.nodes.begin(), merged.nodes.end(), std::back_inserter(network.nodes));
+            std::move(merged.outputs.begin(), merged.outputs.end(), std::back_inserter(network.outputs));
+        }
+    }
+    if (m_incremental) {
+        remove_stale_prims(network);
+    }
+    author(network);
+}
+
+void
+AiShaderExport::begin_concurrent_export() {
+    m_concurrent = true;
+}
+
+SdfPath
+AiShaderExport::get_node_path(const AtNode* arnold_node) const {
+    const auto it = m_shader_to_usd_path.find(arnold_node);
+    return it == m_shader_to_usd_path.end() ? SdfPath() : it->second;
+}
+
+// Networks are merged in the order of their material or node paths, so
+// the result doesn't depend on which thread exported what first. Different
+// nodes can be gathered at the same path, their names break the tie, and
+// the bindings of a shape are ordered by material.
+void
+AiShaderExport::end_concurrent_export() {
+    TRACE_FUNCTION();
+    if (!m_concurrent) {
+        return;
+    }
+    m_concurrent = false;
+
+    std::vector<staged_network> staged;
+    for (auto& each : m_staged_networks) {
+        std::move(each.begin(), each.end(), std::back_inserter(staged));
+        each.clear();
+    }
+    std::sort(staged.begin(), staged.end(),
+              [] (const staged_network& a, const staged_network& b) -> bool {
+                  return a.key < b.key || (a.key == b.key && a.name < b.name);
+              });
+    std::vector<exported_network> networks;
+    networks.reserve(staged.size());
+    for (auto& each : staged) {
+        networks.push_back(std::move(each.network));
+    }
+    author_networks(networks);
+
+    std::vector<std::pair<SdfPath, SdfPath>> bindings;
+    for (auto& each : m_staged_bindings) {
+        std::move(each.begin(), each.end(), std::back_inserter(bindings));
+        each.clear();
+    }
+    std::sort(bindings.begin(), bindings.end(),
+              [] (const std::pair<SdfPath, SdfPath>& a, const std::pair<SdfPath, SdfPath>& b) -> bool {
+                  return a.second < b.second || (a.second == b.second && a.first < b.first);
+              });
+    bind_materials(bindings);
+    m_concurrent_materials.clear();
+}
+
+namespace {
+    // One entry per prim of the hierarchies being collapsed, in pre-order.
+    struct binding_entry {
+        enum action_t : uint8_t { KEEP, SET, REMOVE };
+
+        SdfPath path;
+        std::vector<size_t> children;
+        SdfPathVector targets; // authored, then the collapsed targets
+        bool xform;
+        bool authored; // has a material binding before collapsing
+        bool bound; // has a material binding after collapsing
+        bool collapsed;
+        bool pending; // bound by the current bind_materials call
+        action_t action;
+    };
+    using binding_table = std::vector<binding_entry>;
+
+    using pending_bindings = std::unordered_map<SdfPath, SdfPath, SdfPath::Hash>;
+
+    // Pending bindings replace the ones on the stage.
+    void read_bindings(const UsdPrim& root, binding_table& table, const pending_bindings* pending = nullptr) {
+        std::vector<size_t> parents;
+        auto range = UsdPrimRange::PreAndPostVisit(root, UsdPrimAllPrimsPredicate);
+        for (auto it = range.begin(); it != range.end(); ++it) {
+            if (it.IsPostVisit()) {
+                parents.pop_back();
+                continue;
+            }
+            const auto index = table.size();
+            if (!parents.empty()) {
+                table[parents.back()].children.push_back(index);
+            }
+            parents.push_back(index);
+            table.push_back(binding_entry {it->GetPath(), {}, {}, it->IsA<UsdGeomXform>(),
+                                           false, false, false, false, binding_entry::KEEP});
+            auto& entry = table.back();
+            const auto pending_it = pending == nullptr ? pending_bindings::const_iterator() : pending->find(entry.path);
+            if (pending != nullptr && pending_it != pending->end()) {
+                entry.targets = SdfPathVector {pending_it->second};
+                entry.authored = true;
+                entry.bound = true;
+                entry.pending = true;
+            } else if (it->HasRelationship(UsdShadeTokens->materialBinding)) {
+                it->GetRelationship(UsdShadeTokens->materialBinding).GetTargets(&entry.targets);
+                entry.authored = true;
+                entry.bound = true;
+            }
+            // Only children of xforms are collapsed, the rest is never read.
+            if (!entry.xform) {
+                it.PruneChildren();
+            }
+        }
+    }
+
+    // Moves the binding of an xform's children to the xform when they all
+    // share the same one, starting from the leaves. Subtrees only touch
+    // their own entries and each entry's action is decided by its parent,
+    // so siblings are processed in parallel.
+    void collapse_bindings(binding_table& table, size_t index) {
+        auto& entry = table[index];
+        if (!entry.xform || entry.children.empty()) {
+            return;
+        }
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, entry.children.size()),
+            [&] (const tbb::blocked_range<size_t>& range) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    collapse_bindings(table, entry.children[i]);
+                }
+            });
+
+        const auto& first = table[entry.children.front()];
+        auto collapse = first.bound && !first.targets.empty();
+        for (auto i = decltype(entry.children.size()){1}; collapse && i < entry.children.size(); ++i) {
+            const auto& child = table[entry.children[i]];
+            collapse = child.bound && child.targets == first.targets;
+        }
+
+        if (collapse) {
+            entry.targets = first.targets;
+            entry.bound = true;
+            entry.collapsed = true;
+            for (const auto child : entry.children) {
+                table[child].action = table[child].authored ? binding_entry::REMOVE : binding_entry::KEEP;
+            }
+        } else {
+            for (const auto child : entry.children) {
+                table[child].action = table[child].collapsed ? binding_entry::SET : binding_entry::KEEP;
+            }
+        }
+    }
+
+    void collapse_roots(binding_table& table, const std::vector<size_t>& roots) {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, roots.size()),
+            [&] (const tbb::blocked_range<size_t>& range) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    auto& root = table[roots[i]];
+                    collapse_bindings(table, roots[i]);
+                    root.action = root.collapsed ? binding_entry::SET : binding_entry::KEEP;
+                }
+            });
+    }
+
+    // Bindings are written straight to the edit target's layer, so the
+    // stage paths are mapped to the layer's namespace first, to respect
+    // variant and reference edit targets like UsdRelationship does.
+    bool write_binding(const UsdEditTarget& edit_target, const SdfPath& path, const SdfPathVector& targets) {
+        const auto& layer = edit_target.GetLayer();
+        const auto spec_path = edit_target.MapToSpecPath(path);
+        if (!layer || spec_path.IsEmpty()) {
+            return false;
+        }
+        auto prim = SdfCreatePrimInLayer(layer, spec_path);
+        if (!prim) {
+            return false;
+        }
+        auto rel = layer->GetRelationshipAtPath(spec_path.AppendProperty(UsdShadeTokens->materialBinding));
+        if (!rel) {
+            rel = SdfRelationshipSpec::New(prim, UsdShadeTokens->materialBinding.GetString(), true);
+        }
+        if (!rel) {
+            return false;
+        }
+        rel->GetTargetPathList().ClearEditsAndMakeExplicit();
+        for (const auto& target : targets) {
+            const auto spec_target = edit_target.MapToSpecPath(target);
+            if (!spec_target.IsEmpty()) {
+                rel->GetTargetPathList().Add(spec_target);
+            }
+        }
+        return true;
+    }
+
+    bool remove_binding(const UsdEditTarget& edit_target, const SdfPath& path) {
+        const auto& layer = edit_target.GetLayer();
+        const auto spec_path = edit_target.MapToSpecPath(path);
+        if (!layer || spec_path.IsEmpty()) {
+            return false;
+        }
+        auto prim = layer->GetPrimAtPath(spec_path);
+        auto rel = layer->GetRelationshipAtPath(spec_path.AppendProperty(UsdShadeTokens->materialBinding));
+        if (prim && rel) {
+            prim->RemoveProperty(rel);
+            return true;
+        }
+        return false;
+    }
+}
+
+void AiShaderExport::collapse_shaders() { 
+    TRACE_FUNCTION();
+    scoped_timer timer(m_stats.collapse_time);
+    // shaders and instances are in a scope, everything else is simple hierarchy
+    // with mostly shader assignments
+    binding_table table;
+    std::vector<size_t> roots;
+    for (const auto& prim : m_stage->GetPseudoRoot().GetChildren()) {
+        if (prim.IsA<UsdGeomXform>()) {
+            roots.push_back(table.size());
+            read_bindings(prim, table);
+        }
+    }
+
+    collapse_roots(table, roots);
+
+    const auto& edit_target = m_stage->GetEditTarget();
+    SdfChangeBlock change_block;
+    for (const auto& entry : table) {
+        if (entry.action == binding_entry::REMOVE) {
+            if (remove_binding(edit_target, entry.path)) {
+                ++m_stats.bindings_removed;
+            }
+        } else if (entry.action == binding_entry::SET) {
+            if (write_binding(edit_target, entry.path, entry.targets)) {
+                ++m_stats.bindings_collapsed;
+            }
+        }
+    }
+}
+
+void
+AiShaderExport::bind_materials(const std::vector<std::pair<SdfPath, SdfPath>>& bindings, bool group) {
+    TRACE_FUNCTION();
+    if (m_concurrent) {
+        auto& staged = m_staged_bindings.local();
+        staged.insert(staged.end(), bindings.begin(), bindings.end());
+        return;
+    }
+    if (m_sampling) {
+        m_sampled_bindings.push_back(std::make_pair(bindings, group));
+        return;
+    }
+    scoped_timer timer(m_stats.bind_time);
+    // Each path is only looked up once, the last binding of a shape wins.
+    std::unordered_map<SdfPath, bool, SdfPath::Hash> valid_paths;
+    auto is_valid = [&] (const SdfPath& path) -> bool {
+        auto it = valid_paths.find(path);
+        if (it == valid_paths.end()) {
+            it = valid_paths.insert(std::make_pair(path, m_stage->GetPrimAtPath(path).IsValid())).first;
+        }
+        return it->second;
+    };
+    pending_bindings pending;
+    for (const auto& each : bindings) {
+        if (is_valid(each.second) && is_valid(each.first)) {
+            pending[each.second] = each.first;
+        }
+    }
+
+    // Grouping reads the hierarchies of the bound shapes with the pending
+    // bindings applied, so the result is the same as binding one by one
+    // and collapsing afterwards.
+    binding_table table;
+    if (group) {
+        std::set<SdfPath> root_paths;
+        for (const auto& each : pending) {
+            root_paths.insert(each.first.GetPrefixes().front());
+        }
+        std::vector<size_t> roots;
+        for (const auto& root_path : root_paths) {
+            const auto root = m_stage->GetPrimAtPath(root_path);
+            if (root.IsValid() && root.IsA<UsdGeomXform>()) {
+                roots.push_back(table.size());
+                read_bindings(root, table, &pending);
+            }
+        }
+        collapse_roots(table, roots);
+    }
+
+    const auto& edit_target = m_stage->GetEditTarget();
+    SdfChangeBlock change_block;
+    for (const auto& entry : table) {
+        if (entry.pending) {
+            pending.erase(entry.path);
+        }
+        if (entry.action == binding_entry::REMOVE) {
+            if (remove_binding(edit_target, entry.path)) {
+                ++m_stats.bindings_removed;
+            }
+        } else if (entry.action == binding_entry::SET) {
+            if (write_binding(edit_target, entry.path, entry.targets)) {
+                ++m_stats.bindings_collapsed;
+            }
+        } else if (entry.pending) {
+            if (write_binding(edit_target, entry.path, entry.targets)) {
+                ++m_stats.bindings_authored;
+            }
+        }
+    }
+    for (const auto& each : pending) {
+        if (write_binding(edit_target, each.first, SdfPathVector {each.second})) {
+            ++m_stats.bindings_authored;
+        }
+    }
+}
+
+AiShaderExport::export_stats
+AiShaderExport::get_stats() const {
+    auto stats = m_stats;
+    stats.nodes_gathered = m_nodes_gathered;
+    stats.inputs_elided = m_inputs_elided;
+    stats.arrays_copied = m_arrays_copied;
+    stats.array_bytes_copied = m_array_bytes_copied;
+    stats.entry_cache_hits = m_entry_cache_hits;
+    stats.entry_cache_misses = m_entry_cache_misses;
+    return stats;
+}
+
+void
+AiShaderExport::reset_stats() {
+    m_stats = export_stats();
+    m_nodes_gathered = 0;
+    m_inputs_elided = 0;
+    m_arrays_copied = 0;
+    m_array_bytes_copied = 0;
+    m_entry_cache_hits = 0;
+    m_entry_cache_misses = 0;
+}
 
 PXR_NAMESPACE_CLOSE_SCOPE
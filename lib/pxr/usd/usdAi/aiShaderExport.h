@@ -5,20 +5,85 @@
 
 #include <ai.h>
 
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <tbb/concurrent_unordered_set.h>
+#include <tbb/enumerable_thread_specific.h>
+
 PXR_NAMESPACE_OPEN_SCOPE
 
 class AiShaderExport {
 public:
+    // How exported networks are written. The stage mode goes through the
+    // UsdShade API one property at a time, the layer mode writes specs
+    // directly to the edit target's layer in a single change block.
+    enum AuthoringMode {
+        AUTHORING_MODE_STAGE,
+        AUTHORING_MODE_LAYER
+    };
+
+    // Timings are in seconds and, like the counters, accumulated since the
+    // exporter was created or the stats were last reset.
+    struct export_stats {
+        double gather_time = 0.0;
+        double merge_time = 0.0;
+        double author_time = 0.0;
+        double bind_time = 0.0;
+        double collapse_time = 0.0;
+        size_t nodes_gathered = 0;
+        size_t nodes_deduplicated = 0;
+        size_t inputs_authored = 0;
+        size_t inputs_elided = 0;
+        size_t connections_authored = 0;
+        size_t arrays_copied = 0;
+        size_t array_bytes_copied = 0;
+        size_t bindings_authored = 0;
+        size_t bindings_collapsed = 0;
+        size_t bindings_removed = 0;
+        size_t inputs_sampled = 0;
+        size_t materials_unchanged = 0;
+        size_t prims_orphaned = 0;
+        size_t entry_cache_hits = 0;
+        size_t entry_cache_misses = 0;
+    };
+
+    struct material_desc {
+        std::string name;
+        AtNode* surf_shader;
+        AtNode* disp_shader;
+    };
+
     AiShaderExport(const UsdStagePtr& _stage,
                    const SdfPath& parent_scope = SdfPath(),
                    const UsdTimeCode& _time_code = UsdTimeCode::Default());
     ~AiShaderExport() = default;
     void bind_material(const SdfPath& shader_path, const SdfPath& shape_path);
+    // Binds (material path, shape path) pairs in a single change block. With
+    // group, bindings shared by all the children of an xform are moved to
+    // the xform, like collapse_shaders does.
+    void bind_materials(const std::vector<std::pair<SdfPath, SdfPath>>& bindings, bool group=false);
     SdfPath export_material(const char* material_name,
                             AtNode* surf_shader, AtNode* disp_shader=nullptr);
+    // Reads the networks of all the materials in parallel, then authors them
+    // in order. The result is the same as calling export_material for each.
+    std::vector<SdfPath> export_materials(const std::vector<material_desc>& materials);
     SdfPath export_arnold_node(const AtNode* arnold_node,
                                SdfPath& parent_path, const std::set<std::string>* exportable_params = nullptr);
+    // Gathers the nodes in parallel, then authors them in order. The result
+    // is the same as calling export_arnold_node for each, nodes that are not
+    // exported get an empty path.
+    std::vector<SdfPath> export_arnold_nodes(const std::vector<const AtNode*>& arnold_nodes,
+                                             const SdfPath& parent_path,
+                                             const std::set<std::string>* exportable_params = nullptr);
     static void clean_arnold_name(std::string& name);
+    // Arnold and material names that collided with another name once
+    // cleaned, with the suffixed path they were exported to. Names that
+    // were only cleaned are not listed, see clean_arnold_name.
+    const std::vector<std::pair<std::string, SdfPath>>& get_renamed() const { return m_renamed; }
     bool get_output(const AtNode* src_arnold_node, UsdAiShader& src_shader, UsdShadeOutput& out,
                     bool is_node_type=false, int32_t comp_index=-1);
     bool export_connection(const AtNode* dest_arnold_node, UsdAiShader& dest_shader,
@@ -37,13 +102,255 @@ public:
                           uint8_t arnold_param_type, bool user);
     void collapse_shaders();
 
+    // Reuses an already exported prim for nodes with the same type, values
+    // and upstream network, instead of exporting each Arnold node.
+    void set_deduplicate_nodes(bool deduplicate) { m_deduplicate_nodes = deduplicate; }
+    bool get_deduplicate_nodes() const { return m_deduplicate_nodes; }
+    // Nodes not directly assigned to a material are exported under this
+    // scope of the shaders scope, or in the shaders scope when empty.
+    void set_shared_scope(const std::string& scope_name);
+    SdfPath get_shared_scope() const { return m_shared_scope; }
+
+    // Skips parameters that are not connected and have their default value.
+    void set_sparse(bool sparse) { m_sparse = sparse; }
+    bool get_sparse() const { return m_sparse; }
+
+    // Exports materials that already exist on the stage again, but only
+    // authors the ones whose network changed since they were exported.
+    void set_incremental(bool incremental) { m_incremental = incremental; }
+    bool get_incremental() const { return m_incremental; }
+    // Removes the materials and shaders from the shaders scope that were
+    // not exported by this exporter, for use after an incremental export.
+    void remove_orphaned();
+
+    void set_time_code(const UsdTimeCode& time_code) { m_time_code = time_code; }
+    UsdTimeCode get_time_code() const { return m_time_code; }
+    // Materials exported between these calls are authored when sampling
+    // ends. Export them after setting each time code, inputs with the same
+    // value at every time are authored as defaults, the others as time
+    // samples. Connections are taken from the first time exported at.
+    // Bindings made while sampling are applied once the materials are
+    // authored, at the end.
+    void begin_time_samples();
+    void end_time_samples();
+
+    // Between these calls export_material, export_arnold_node and
+    // bind_material can be called from several threads. They only read
+    // Arnold and the stage, everything is merged and authored in a
+    // deterministic order when the concurrent export ends.
+    // The paths export_arnold_node returns in between are the paths the
+    // nodes were gathered at, nodes can still be renamed or replaced by an
+    // identical one when merging, use get_node_path afterwards for the
+    // authored paths. Material paths are final.
+    void begin_concurrent_export();
+    void end_concurrent_export();
+    // Path an Arnold node was authored at, empty if it was not exported.
+    SdfPath get_node_path(const AtNode* arnold_node) const;
+
+    void set_authoring_mode(AuthoringMode mode) { m_authoring_mode = mode; }
+    AuthoringMode get_authoring_mode() const { return m_authoring_mode; }
+
+    export_stats get_stats() const;
+    void reset_stats();
+
 protected:
+    SdfPath get_material_path(const char* material_name);
+
     const UsdStagePtr m_stage;
     SdfPath m_shaders_scope;
     UsdTimeCode m_time_code;
 
 private:
+    struct component_desc {
+        std::string arnold_name; // param.r
+        TfToken usd_name; // param:r
+    };
+
+    // Everything about a parameter that does not depend on the node instance.
+    struct param_desc {
+        AtString name;
+        TfToken token;
+        uint8_t type;
+        SdfValueTypeName usd_type;
+        std::vector<TfToken> enum_tokens;
+        std::vector<component_desc> components;
+        // param[i] and param:ii, grown on demand for the longest array seen.
+        mutable std::deque<component_desc> elements;
+        VtValue default_value; // empty when there is no default to compare to
+        bool linkable;
+    };
+
+    struct entry_desc {
+        TfToken id;
+        std::vector<param_desc> params;
+        bool linkable;
+    };
+
+    // Built once per node, so unlinked parameters don't have to be probed
+    // again while exporting.
+    struct param_links {
+        bool linked;
+        std::vector<uint32_t> elements;
+    };
+    using link_index = std::vector<param_links>;
+
+    // Arnold networks are first read into these, then authored in one go.
+    struct exported_input {
+        TfToken name;
+        SdfValueTypeName type;
+        VtValue value;
+        int motion_keys;
+        bool user;
+        SdfPath source; // empty when not connected
+        TfToken source_output;
+        std::vector<std::pair<double, VtValue>> samples; // authored instead of value when not empty
+    };
+
+    struct exported_output {
+        SdfPath node;
+        TfToken name;
+        SdfValueTypeName type;
+    };
+
+    struct exported_node {
+        const AtNode* arnold_node;
+        SdfPath path;
+        TfToken id; // empty when adding inputs to an existing shader
+        std::vector<exported_input> inputs;
+        bool cyclic; // part of, or downstream of a cycle
+    };
+
+    struct exported_material {
+        SdfPath path;
+        SdfPath surface;
+        SdfPath displacement;
+        uint64_t fingerprint; // 0 when not exported incrementally
+    };
+
+    // Nodes whose parameters are not gathered yet.
+    struct pending_node {
+        size_t index;
+        const entry_desc* entry;
+        const std::set<std::string>* exportable_params;
+    };
+
+    struct exported_network {
+        std::vector<exported_material> materials;
+        std::vector<exported_node> nodes;
+        std::vector<exported_output> outputs;
+        // Nodes gathered into this network, not yet in m_shader_to_usd_path.
+        std::map<const AtNode*, SdfPath> node_paths;
+        std::unordered_map<SdfPath, std::string, SdfPath::Hash> path_owners;
+        std::vector<pending_node> pending;
+    };
+    using path_owners = std::unordered_map<SdfPath, std::string, SdfPath::Hash>;
+
+    static param_desc make_param_desc(const AtNodeEntry* nentry, const AtParamEntry* pentry);
+    static const component_desc& get_element_desc(const param_desc& param, uint32_t index);
+    static void probe_links(const AtNode* arnold_node, const param_desc& param, param_links& links);
+    const entry_desc& get_entry_desc(const AtNodeEntry* nentry);
+    static void build_link_index(const AtNode* arnold_node, const entry_desc& entry, link_index& links);
+    static std::vector<component_desc> make_components(const std::string& usd_name,
+                                                       const std::string& arnold_name, uint8_t type);
+    static size_t add_node(const AtNode* arnold_node, const SdfPath& path, const TfToken& id,
+                           exported_network& network);
+
+    SdfPath gather_node(const AtNode* arnold_node, const SdfPath& parent_path,
+                        const std::set<std::string>* exportable_params, exported_network& network);
+    SdfPath add_to_worklist(const AtNode* arnold_node, const SdfPath& parent_path,
+                            const std::set<std::string>* exportable_params, exported_network& network);
+    void process_worklist(exported_network& network);
+    void sort_network(exported_network& network);
+    void gather_parameter(const AtNode* arnold_node, const param_desc& param, const param_links& links,
+                          size_t node_index, exported_network& network);
+    void gather_user_parameter(const AtNode* arnold_node, const char* arnold_param_name,
+                               uint8_t arnold_param_type, size_t node_index, exported_network& network);
+    bool gather_connection(const AtNode* dest_arnold_node, const TfToken& dest_param_name,
+                           const char* dest_param_arnold_name, uint8_t arnold_param_type,
+                           const std::vector<component_desc>& components,
+                           size_t node_index, exported_network& network);
+
+    void gather_material(const SdfPath& material_path, AtNode* surf_shader, AtNode* disp_shader,
+                         exported_network& network);
+    struct sampled_frame {
+        UsdTimeCode time;
+        std::set<SdfPath> materials;
+        std::vector<exported_network> networks;
+    };
+
+    struct staged_network {
+        SdfPath key;
+        std::string name; // Arnold node or material name, breaks ties between keys
+        exported_network network;
+    };
+
+    struct shared_node {
+        SdfPath path;
+        TfToken id;
+        std::vector<exported_input> inputs;
+    };
+
+    SdfPath get_unique_path(const SdfPath& parent_path, const std::string& name,
+                            const path_owners* network_owners);
+    bool register_path(const SdfPath& path, const std::string& name);
+    static size_t hash_node(const exported_node& node);
+    static bool same_inputs(const std::vector<exported_input>& a, const std::vector<exported_input>& b);
+    void merge_network(exported_network& source, exported_network& target);
+    void merge_and_author(exported_network& network);
+    uint64_t fingerprint_network(const exported_network& network) const;
+    void set_fingerprint(exported_network& network) const;
+    bool is_unchanged(const exported_material& material);
+    void remove_stale_prims(const exported_network& network);
+    void author_networks(std::vector<exported_network>& networks);
+    sampled_frame& get_sampled_frame();
+
+    void author(const exported_network& network);
+    void author_stage(const exported_network& network);
+    void author_layer(const exported_network& network);
+
     std::map<const AtNode*, SdfPath> m_shader_to_usd_path;
+    // Arnold or material name each exported path was created for.
+    path_owners m_path_owners;
+    // Names that got a suffixed path, by the path of their clean name, and
+    // the first suffix not registered for it.
+    struct name_collisions {
+        std::unordered_map<std::string, SdfPath> paths;
+        size_t next_suffix = 1;
+    };
+    std::unordered_map<SdfPath, name_collisions, SdfPath::Hash> m_collisions;
+    std::unordered_map<std::string, SdfPath> m_material_paths;
+    std::mutex m_path_owners_mutex;
+    std::vector<std::pair<std::string, SdfPath>> m_renamed;
+    std::unordered_map<const AtNodeEntry*, entry_desc> m_entry_descs;
+    std::mutex m_entry_descs_mutex;
+    // Nodes already reported as part of a cycle, networks are sorted in parallel.
+    std::unordered_set<const AtNode*> m_cyclic_nodes;
+    std::mutex m_cyclic_nodes_mutex;
+    // Stats updated while gathering networks in parallel, the rest of them
+    // is only updated from the calling thread.
+    export_stats m_stats;
+    std::atomic<size_t> m_nodes_gathered;
+    std::atomic<size_t> m_inputs_elided;
+    std::atomic<size_t> m_arrays_copied;
+    std::atomic<size_t> m_array_bytes_copied;
+    std::atomic<size_t> m_entry_cache_hits;
+    std::atomic<size_t> m_entry_cache_misses;
+    // Exported nodes by the hash of their type, inputs and connections.
+    std::unordered_multimap<size_t, shared_node> m_shared_nodes;
+    SdfPath m_shared_scope;
+    AuthoringMode m_authoring_mode;
+    bool m_deduplicate_nodes;
+    bool m_sparse;
+    bool m_incremental;
+    bool m_sampling;
+    std::vector<sampled_frame> m_sampled_frames;
+    // bind_materials calls made while sampling, with their group flag.
+    std::vector<std::pair<std::vector<std::pair<SdfPath, SdfPath>>, bool>> m_sampled_bindings;
+    bool m_concurrent;
+    tbb::concurrent_unordered_set<SdfPath, SdfPath::Hash> m_concurrent_materials;
+    tbb::enumerable_thread_specific<std::vector<staged_network>> m_staged_networks;
+    tbb::enumerable_thread_specific<std::vector<std::pair<SdfPath, SdfPath>>> m_staged_bindings;
+    std::set<SdfPath> m_exported_materials;
 
 };
 
@@ -0,0 +1,521 @@
+#include "pxr/usd/usdAi/aiShaderImport.h"
+
+#include "pxr/base/gf/matrix4d.h"
+#include "pxr/base/tracelite/trace.h"
+#include "pxr/usd/usdAi/tokens.h"
+#include "pxr/usd/usdAi/aiMaterialAPI.h"
+#include "pxr/usd/usdAi/aiNodeAPI.h"
+#include "pxr/usd/usd/relationship.h"
+#include "pxr/usd/usdShade/connectableAPI.h"
+#include "pxr/usd/usdShade/input.h"
+
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/tick_count.h>
+
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+namespace {
+
+    // Adds the time spent in the scope to a stats field.
+    class scoped_timer {
+    public:
+        explicit scoped_timer(double& seconds) : m_seconds(seconds), m_start(tbb::tick_count::now()) { }
+        ~scoped_timer() { m_seconds += (tbb::tick_count::now() - m_start).seconds(); }
+    private:
+        double& m_seconds;
+        tbb::tick_count m_start;
+    };
+
+    // The reverse of the names AiShaderExport authors, param:r is param.r
+    // and param:i2 is param[2].
+    std::string arnold_param_name(const std::string& usd_name) {
+        std::string name;
+        size_t start = 0;
+        while (start <= usd_name.size()) {
+            auto end = usd_name.find(':', start);
+            if (end == std::string::npos) {
+                end = usd_name.size();
+            }
+            const auto part = usd_name.substr(start, end - start);
+            if (start == 0) {
+                name = part;
+            } else if (part.size() > 1 && part[0] == 'i' &&
+                       part.find_first_not_of("0123456789", 1) == std::string::npos) {
+                name += "[" + part.substr(1) + "]";
+            } else {
+                name += "." + part;
+            }
+            start = end + 1;
+        }
+        return name;
+    }
+
+    const TfToken& motion_keys_key() {
+        const static TfToken key("motionKeys");
+        return key;
+    }
+
+    // Arnold type of the values AiShaderExport authors, for user parameters
+    // and arrays, where the node entry doesn't tell.
+    uint8_t get_arnold_type(const VtValue& value) {
+        if (value.IsHolding<uint8_t>() || value.IsHolding<VtArray<uint8_t>>()) {
+            return AI_TYPE_BYTE;
+        } else if (value.IsHolding<int32_t>() || value.IsHolding<VtArray<int32_t>>()) {
+            return AI_TYPE_INT;
+        } else if (value.IsHolding<uint32_t>() || value.IsHolding<VtArray<uint32_t>>()) {
+            return AI_TYPE_UINT;
+        } else if (value.IsHolding<bool>() || value.IsHolding<VtArray<bool>>()) {
+            return AI_TYPE_BOOLEAN;
+        } else if (value.IsHolding<float>() || value.IsHolding<VtArray<float>>()) {
+            return AI_TYPE_FLOAT;
+        } else if (value.IsHolding<GfVec3f>() || value.IsHolding<VtArray<GfVec3f>>()) {
+            return AI_TYPE_RGB;
+        } else if (value.IsHolding<GfVec4f>() || value.IsHolding<VtArray<GfVec4f>>()) {
+            return AI_TYPE_RGBA;
+        } else if (value.IsHolding<GfVec2f>() || value.IsHolding<VtArray<GfVec2f>>()) {
+            return AI_TYPE_VECTOR2;
+        } else if (value.IsHolding<std::string>() || value.IsHolding<VtArray<std::string>>()) {
+            return AI_TYPE_STRING;
+        } else if (value.IsHolding<GfMatrix4d>() || value.IsHolding<VtArray<GfMatrix4d>>()) {
+            return AI_TYPE_MATRIX;
+        }
+        return AI_TYPE_NONE;
+    }
+
+    AtMatrix convert_matrix(const GfMatrix4d& in) {
+        AtMatrix out;
+        const auto* src = in.GetArray();
+        for (auto i = 0; i < 16; ++i) {
+            out.data[i / 4][i % 4] = static_cast<float>(src[i]);
+        }
+        return out;
+    }
+
+    // Vectors and colors share the same GfVec3f values, the parameter type
+    // decides which one is set.
+    bool set_value(AtNode* arnold_node, const char* name, uint8_t type, const VtValue& value) {
+        switch (type) {
+            case AI_TYPE_BYTE:
+                if (!value.IsHolding<uint8_t>()) { return false; }
+                AiNodeSetByte(arnold_node, name, value.UncheckedGet<uint8_t>());
+                return true;
+            case AI_TYPE_INT:
+                if (!value.IsHolding<int32_t>()) { return false; }
+                AiNodeSetInt(arnold_node, name, value.UncheckedGet<int32_t>());
+                return true;
+            case AI_TYPE_UINT:
+                if (!value.IsHolding<uint32_t>()) { return false; }
+                AiNodeSetUInt(arnold_node, name, value.UncheckedGet<uint32_t>());
+                return true;
+            case AI_TYPE_BOOLEAN:
+                if (!value.IsHolding<bool>()) { return false; }
+                AiNodeSetBool(arnold_node, name, value.UncheckedGet<bool>());
+                return true;
+            case AI_TYPE_FLOAT:
+                if (!value.IsHolding<float>()) { return false; }
+                AiNodeSetFlt(arnold_node, name, value.UncheckedGet<float>());
+                return true;
+            case AI_TYPE_RGB:
+                if (!value.IsHolding<GfVec3f>()) { return false; } else {
+                    const auto& v = value.UncheckedGet<GfVec3f>();
+                    AiNodeSetRGB(arnold_node, name, v[0], v[1], v[2]);
+                }
+                return true;
+            case AI_TYPE_RGBA:
+                if (!value.IsHolding<GfVec4f>()) { return false; } else {
+                    const auto& v = value.UncheckedGet<GfVec4f>();
+                    AiNodeSetRGBA(arnold_node, name, v[0], v[1], v[2], v[3]);
+                }
+                return true;
+            case AI_TYPE_VECTOR:
+                if (!value.IsHolding<GfVec3f>()) { return false; } else {
+                    const auto& v = value.UncheckedGet<GfVec3f>();
+                    AiNodeSetVec(arnold_node, name, v[0], v[1], v[2]);
+                }
+                return true;
+            case AI_TYPE_VECTOR2:
+                if (!value.IsHolding<GfVec2f>()) { return false; } else {
+                    const auto& v = value.UncheckedGet<GfVec2f>();
+                    AiNodeSetVec2(arnold_node, name, v[0], v[1]);
+                }
+                return true;
+            // Enums are exported as their string value.
+            case AI_TYPE_STRING:
+            case AI_TYPE_ENUM:
+                if (!value.IsHolding<std::string>()) { return false; }
+                AiNodeSetStr(arnold_node, name, value.UncheckedGet<std::string>().c_str());
+                return true;
+            case AI_TYPE_MATRIX:
+                if (!value.IsHolding<GfMatrix4d>()) { return false; }
+                AiNodeSetMatrix(arnold_node, name, convert_matrix(value.UncheckedGet<GfMatrix4d>()));
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    template <typename T>
+    AtArray* convert_array(const VtValue& value, uint32_t motion_keys, uint8_t type) {
+        const auto& arr = value.UncheckedGet<VtArray<T>>();
+        const auto num_elements = static_cast<uint32_t>(arr.size() / motion_keys);
+        return AiArrayConvert(num_elements, static_cast<uint8_t>(motion_keys), type, arr.data());
+    }
+
+    // Motion keys are stored one after the other, both in Arnold and in USD.
+    // The array type is taken from the parameter's default when there is
+    // one, vector and color arrays are stored the same way.
+    AtArray* make_array(const VtValue& value, int motion_keys, uint8_t array_type) {
+        const auto keys = static_cast<uint32_t>(std::max(motion_keys, 1));
+        if (value.GetArraySize() == 0 || value.GetArraySize() % keys != 0) {
+            return nullptr;
+        }
+        const auto stored_type = get_arnold_type(value);
+        const auto type = array_type == AI_TYPE_NONE ? stored_type : array_type;
+        switch (stored_type) {
+            case AI_TYPE_BYTE: return convert_array<uint8_t>(value, keys, type);
+            case AI_TYPE_INT: return convert_array<int32_t>(value, keys, type);
+            case AI_TYPE_UINT: return convert_array<uint32_t>(value, keys, type);
+            case AI_TYPE_BOOLEAN: return convert_array<bool>(value, keys, type);
+            case AI_TYPE_FLOAT: return convert_array<float>(value, keys, type);
+            case AI_TYPE_RGB: return convert_array<GfVec3f>(value, keys, type);
+            case AI_TYPE_RGBA: return convert_array<GfVec4f>(value, keys, type);
+            case AI_TYPE_VECTOR2: return convert_array<GfVec2f>(value, keys, type);
+            case AI_TYPE_STRING: {
+                const auto& arr = value.UncheckedGet<VtArray<std::string>>();
+                const auto num_elements = static_cast<uint32_t>(arr.size() / keys);
+                auto* out = AiArrayAllocate(num_elements, static_cast<uint8_t>(keys), type);
+                for (auto i = decltype(arr.size()){0}; i < arr.size(); ++i) {
+                    AiArraySetStr(out, static_cast<uint32_t>(i), arr[i].c_str());
+                }
+                return out;
+            }
+            case AI_TYPE_MATRIX: {
+                const auto& arr = value.UncheckedGet<VtArray<GfMatrix4d>>();
+                const auto num_elements = static_cast<uint32_t>(arr.size() / keys);
+                auto* out = AiArrayAllocate(num_elements, static_cast<uint8_t>(keys), type);
+                for (auto i = decltype(arr.size()){0}; i < arr.size(); ++i) {
+                    AiArraySetMtx(out, static_cast<uint32_t>(i), convert_matrix(arr[i]));
+                }
+                return out;
+            }
+            default:
+                return nullptr;
+        }
+    }
+}
+
+AiShaderImport::AiShaderImport(const UsdStagePtr& _stage, const UsdTimeCode& _time_code) :
+    m_stage(_stage),
+    m_time_code(_time_code)
+{
+    m_objects_changed_key = TfNotice::Register(TfCreateWeakPtr(this), &AiShaderImport::on_objects_changed,
+                                               m_stage);
+}
+
+AiShaderImport::~AiShaderImport() {
+    TfNotice::Revoke(m_objects_changed_key);
+}
+
+AiShaderImport::imported_material
+AiShaderImport::import_material(const SdfPath& material_path) {
+    return import_materials(std::vector<SdfPath> {material_path}).front();
+}
+
+std::vector<AiShaderImport::imported_material>
+AiShaderImport::import_materials(const std::vector<SdfPath>& material_paths) {
+    TRACE_FUNCTION();
+    std::vector<imported_material> imported(material_paths.size());
+    // Indices of the materials that have to be read from the stage.
+    std::vector<size_t> missing;
+    {
+        std::lock_guard<std::mutex> lock(m_networks_mutex);
+        for (auto i = decltype(material_paths.size()){0}; i < material_paths.size(); ++i) {
+            const auto it = m_networks.find(material_paths[i]);
+            if (it == m_networks.end()) {
+                missing.push_back(i);
+                ++m_stats.cache_misses;
+                continue;
+            }
+            ++m_stats.cache_hits;
+            imported[i] = imported_material {material_paths[i], get_arnold_node(it->second.surface),
+                                             get_arnold_node(it->second.displacement)};
+        }
+    }
+    if (missing.empty()) {
+        return imported;
+    }
+
+    // Reading the stage is thread safe, creating nodes is not guaranteed to
+    // be outside of procedurals, so only the reads run in parallel.
+    std::vector<compiled_network> networks(missing.size());
+    {
+        scoped_timer timer(m_stats.read_time);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, missing.size(), 1),
+            [&] (const tbb::blocked_range<size_t>& range) {
+                for (auto i = range.begin(); i != range.end(); ++i) {
+                    networks[i] = compile_network(material_paths[missing[i]]);
+                }
+            });
+    }
+
+    scoped_timer timer(m_stats.create_time);
+    for (auto i = decltype(missing.size()){0}; i < missing.size(); ++i) {
+        const auto& material_path = material_paths[missing[i]];
+        imported[missing[i]] = create_nodes(material_path, networks[i]);
+        std::lock_guard<std::mutex> lock(m_networks_mutex);
+        m_networks[material_path] = std::move(networks[i]);
+    }
+    return imported;
+}
+
+AtNode*
+AiShaderImport::get_arnold_node(const SdfPath& shader_path) const {
+    const auto it = m_nodes.find(shader_path);
+    return it == m_nodes.end() ? nullptr : it->second;
+}
+
+void
+AiShaderImport::set_time_code(const UsdTimeCode& time_code) {
+    if (time_code != m_time_code) {
+        m_time_code = time_code;
+        clear_cache();
+    }
+}
+
+void
+AiShaderImport::clear_cache() {
+    std::lock_guard<std::mutex> lock(m_networks_mutex);
+    m_networks.clear();
+}
+
+// Only reads the stage, so materials can be compiled in parallel. Shaders
+// are collected with a worklist, which also stops at cycles.
+AiShaderImport::compiled_network
+AiShaderImport::compile_network(const SdfPath& material_path) const {
+    TRACE_FUNCTION();
+    compiled_network network;
+    UsdAiMaterialAPI material(m_stage->GetPrimAtPath(material_path));
+    if (!material) {
+        return network;
+    }
+    SdfPathVector targets;
+    if (material.GetSurfaceRel().GetTargets(&targets) && !targets.empty()) {
+        network.surface = targets.front();
+    }
+    targets.clear();
+    if (material.GetDisplacementRel().GetTargets(&targets) && !targets.empty()) {
+        network.displacement = targets.front();
+    }
+
+    std::unordered_set<SdfPath, SdfPath::Hash> visited;
+    std::vector<SdfPath> pending;
+    if (!network.displacement.IsEmpty()) {
+        pending.push_back(network.displacement);
+    }
+    if (!network.surface.IsEmpty()) {
+        pending.push_back(network.surface);
+    }
+    while (!pending.empty()) {
+        const auto path = pending.back();
+        pending.pop_back();
+        if (!visited.insert(path).second) {
+            continue;
+        }
+        // Prims that are not shaders yet still invalidate the network.
+        network.dependencies.push_back(path);
+        const auto prim = m_stage->GetPrimAtPath(path);
+        if (!prim || !prim.IsA<UsdAiShader>()) {
+            continue;
+        }
+        network.shaders.push_back(imported_shader {path, TfToken(), {}});
+        read_shader(prim, network.shaders.back(), pending);
+    }
+    return network;
+}
+
+void
+AiShaderImport::read_shader(const UsdPrim& prim, imported_shader& shader, std::vector<SdfPath>& sources) const {
+    UsdAiShader ai_shader(prim);
+    ai_shader.GetIdAttr().Get(&shader.id);
+    for (const auto& input : ai_shader.GetInputs()) {
+        imported_input imported {arnold_param_name(input.GetBaseName().GetString()), VtValue(), 1, false,
+                                 SdfPath(), TfToken()};
+        UsdShadeConnectableAPI source;
+        UsdShadeAttributeType source_type;
+        if (UsdShadeConnectableAPI::GetConnectedSource(input, &source, &imported.source_output, &source_type)) {
+            imported.source = source.GetPath();
+            sources.push_back(imported.source);
+        } else {
+            const auto attr = input.GetAttr();
+            if (!attr.Get(&imported.value, m_time_code) || imported.value.IsEmpty()) {
+                continue;
+            }
+            VtValue motion_keys = attr.GetCustomDataByKey(motion_keys_key());
+            if (motion_keys.IsHolding<int>()) {
+                imported.motion_keys = motion_keys.UncheckedGet<int>();
+            }
+        }
+        shader.inputs.push_back(std::move(imported));
+    }
+    const auto& user_prefix = UsdAiTokens->userPrefix.GetString();
+    for (const auto& attr : UsdAiNodeAPI(prim).GetUserAttributes()) {
+        imported_input imported {attr.GetName().GetString().substr(user_prefix.size()), VtValue(), 1, true,
+                                 SdfPath(), TfToken()};
+        if (attr.Get(&imported.value, m_time_code) && !imported.value.IsEmpty()) {
+            shader.inputs.push_back(std::move(imported));
+        }
+    }
+}
+
+// All the nodes are created first, so connections don't depend on the
+// order the shaders were read in.
+AiShaderImport::imported_material
+AiShaderImport::create_nodes(const SdfPath& material_path, const compiled_network& network) {
+    TRACE_FUNCTION();
+    std::vector<AtNode*> arnold_nodes;
+    arnold_nodes.reserve(network.shaders.size());
+    for (const auto& shader : network.shaders) {
+        arnold_nodes.push_back(create_node(shader));
+    }
+    for (auto i = decltype(network.shaders.size()){0}; i < network.shaders.size(); ++i) {
+        if (arnold_nodes[i] == nullptr) {
+            continue;
+        }
+        for (const auto& input : network.shaders[i].inputs) {
+            if (input.source.IsEmpty()) {
+                set_input(arnold_nodes[i], input);
+            } else {
+                link_input(arnold_nodes[i], input);
+            }
+        }
+    }
+    return imported_material {material_path, get_arnold_node(network.surface),
+                              get_arnold_node(network.displacement)};
+}
+
+// Nodes created by an earlier import are reset instead, references to them
+// stay valid unless the shader's type changed.
+AtNode*
+AiShaderImport::create_node(const imported_shader& shader) {
+    if (shader.id.IsEmpty()) {
+        return nullptr;
+    }
+    auto& arnold_node = m_nodes[shader.path];
+    if (arnold_node != nullptr) {
+        if (shader.id == AiNodeEntryGetName(AiNodeGetNodeEntry(arnold_node))) {
+            AiNodeReset(arnold_node);
+            ++m_stats.nodes_updated;
+            return arnold_node;
+        }
+        AiNodeDestroy(arnold_node);
+    }
+    arnold_node = AiNode(shader.id.GetText(), shader.path.GetText());
+    if (arnold_node != nullptr) {
+        ++m_stats.nodes_created;
+    }
+    return arnold_node;
+}
+
+void
+AiShaderImport::set_input(AtNode* arnold_node, const imported_input& input) {
+    const auto* name = input.name.c_str();
+    const auto* pentry = AiNodeEntryLookUpParameter(AiNodeGetNodeEntry(arnold_node), name);
+    uint8_t type = AI_TYPE_NONE;
+    if (pentry != nullptr) {
+        type = static_cast<uint8_t>(AiParamGetType(pentry));
+    } else {
+        // User parameters, user arrays are exported as regular inputs.
+        const auto* upentry = AiNodeLookUpUserParameter(arnold_node, name);
+        if (upentry != nullptr) {
+            type = static_cast<uint8_t>(AiUserParamGetType(upentry));
+        } else {
+            const auto is_array = input.value.IsArrayValued();
+            const auto element_type = get_arnold_type(input.value);
+            if (element_type == AI_TYPE_NONE || input.name.find_first_of(".[") != std::string::npos) {
+                return;
+            }
+            std::string declaration(is_array ? "constant ARRAY " : "constant ");
+            declaration += AiParamGetTypeName(element_type);
+            if (!AiNodeDeclare(arnold_node, name, declaration.c_str())) {
+                return;
+            }
+            type = is_array ? static_cast<uint8_t>(AI_TYPE_ARRAY) : element_type;
+        }
+    }
+    if (type == AI_TYPE_ARRAY) {
+        uint8_t array_type = AI_TYPE_NONE;
+        const auto* default_value = pentry == nullptr ? nullptr : AiParamGetDefault(pentry);
+        if (default_value != nullptr && default_value->ARRAY() != nullptr) {
+            array_type = AiArrayGetType(default_value->ARRAY());
+        }
+        auto* arr = make_array(input.value, input.motion_keys, array_type);
+        if (arr == nullptr) {
+            return;
+        }
+        AiNodeSetArray(arnold_node, name, arr);
+    } else if (!set_value(arnold_node, name, type, input.value)) {
+        return;
+    }
+    ++m_stats.inputs_set;
+}
+
+// The output names are the ones AiShaderExport authors, node for node
+// pointers, out for the whole output and the component names otherwise.
+void
+AiShaderImport::link_input(AtNode* arnold_node, const imported_input& input) {
+    auto* source = get_arnold_node(input.source);
+    if (source == nullptr) {
+        return;
+    }
+    const static TfToken node_output("node");
+    const static TfToken out_output("out");
+    if (input.source_output == node_output) {
+        AiNodeSetPtr(arnold_node, input.name.c_str(), source);
+    } else if (input.source_output == out_output) {
+        AiNodeLink(source, input.name.c_str(), arnold_node);
+    } else {
+        AiNodeLinkOutput(source, input.source_output.GetText(), arnold_node, input.name.c_str());
+    }
+    ++m_stats.connections_set;
+}
+
+// Drops the networks that contain a changed prim, they are read again the
+// next time they are imported.
+void
+AiShaderImport::on_objects_changed(const UsdNotice::ObjectsChanged& notice, const UsdStageWeakPtr& sender) {
+    std::vector<SdfPath> changed;
+    for (const auto& path : notice.GetResyncedPaths()) {
+        changed.push_back(path.GetPrimPath());
+    }
+    for (const auto& path : notice.GetChangedInfoOnlyPaths()) {
+        changed.push_back(path.GetPrimPath());
+    }
+    if (changed.empty()) {
+        return;
+    }
+    auto is_changed = [&changed] (const SdfPath& path) -> bool {
+        for (const auto& each : changed) {
+            if (path.HasPrefix(each)) {
+                return true;
+            }
+        }
+        return false;
+    };
+    std::lock_guard<std::mutex> lock(m_networks_mutex);
+    for (auto it = m_networks.begin(); it != m_networks.end();) {
+        const auto& dependencies = it->second.dependencies;
+        if (is_changed(it->first) || std::any_of(dependencies.begin(), dependencies.end(), is_changed)) {
+            it = m_networks.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+PXR_NAMESPACE_CLOSE_SCOPE
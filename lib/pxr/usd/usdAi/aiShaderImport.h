@@ -0,0 +1,114 @@
+#ifndef USDAI_SHADER_IMPORT_H
+#define USDAI_SHADER_IMPORT_H
+
+#include "pxr/usd/usdAi/aiShader.h"
+
+#include "pxr/base/tf/notice.h"
+#include "pxr/base/tf/weakBase.h"
+#include "pxr/usd/usd/notice.h"
+
+#include <ai.h>
+
+#include <mutex>
+#include <unordered_map>
+
+PXR_NAMESPACE_OPEN_SCOPE
+
+// Creates Arnold nodes from the shader networks of UsdAiMaterialAPI
+// materials, the reverse of AiShaderExport. Networks read from the stage
+// are cached per material and dropped when the stage changes them, so
+// importing the same material again is only a lookup.
+class AiShaderImport : public TfWeakBase {
+public:
+    // Timings are in seconds and, like the counters, accumulated since the
+    // importer was created or the stats were last reset.
+    struct import_stats {
+        double read_time = 0.0;
+        double create_time = 0.0;
+        size_t cache_hits = 0;
+        size_t cache_misses = 0;
+        size_t nodes_created = 0;
+        size_t nodes_updated = 0;
+        size_t inputs_set = 0;
+        size_t connections_set = 0;
+    };
+
+    struct imported_material {
+        SdfPath path;
+        AtNode* surface;
+        AtNode* displacement;
+    };
+
+    AiShaderImport(const UsdStagePtr& _stage,
+                   const UsdTimeCode& _time_code = UsdTimeCode::Default());
+    ~AiShaderImport();
+    AiShaderImport(const AiShaderImport&) = delete;
+    AiShaderImport& operator=(const AiShaderImport&) = delete;
+
+    // Nodes are named after their shader prim paths. When a material is
+    // imported again after its network changed, the nodes created for it
+    // before are reset and updated in place.
+    imported_material import_material(const SdfPath& material_path);
+    // Reads the networks of all the materials in parallel, then creates the
+    // nodes in order. The result is the same as calling import_material for
+    // each.
+    std::vector<imported_material> import_materials(const std::vector<SdfPath>& material_paths);
+    // The node created for a shader prim, or nullptr.
+    AtNode* get_arnold_node(const SdfPath& shader_path) const;
+
+    // Changing the time code drops the cached networks.
+    void set_time_code(const UsdTimeCode& time_code);
+    UsdTimeCode get_time_code() const { return m_time_code; }
+    // Forgets the networks read so far, the nodes already created are kept.
+    void clear_cache();
+
+    import_stats get_stats() const { return m_stats; }
+    void reset_stats() { m_stats = import_stats(); }
+
+private:
+    // Input names are already converted to Arnold names, param.r for a
+    // component and param[i] for an array element.
+    struct imported_input {
+        std::string name;
+        VtValue value;
+        int motion_keys;
+        bool user;
+        SdfPath source; // empty when not connected
+        TfToken source_output;
+    };
+
+    struct imported_shader {
+        SdfPath path;
+        TfToken id;
+        std::vector<imported_input> inputs;
+    };
+
+    struct compiled_network {
+        SdfPath surface;
+        SdfPath displacement;
+        std::vector<imported_shader> shaders;
+        std::vector<SdfPath> dependencies; // every prim path read
+    };
+
+    compiled_network compile_network(const SdfPath& material_path) const;
+    void read_shader(const UsdPrim& prim, imported_shader& shader, std::vector<SdfPath>& sources) const;
+    imported_material create_nodes(const SdfPath& material_path, const compiled_network& network);
+    AtNode* create_node(const imported_shader& shader);
+    void set_input(AtNode* arnold_node, const imported_input& input);
+    void link_input(AtNode* arnold_node, const imported_input& input);
+
+    void on_objects_changed(const UsdNotice::ObjectsChanged& notice, const UsdStageWeakPtr& sender);
+
+    const UsdStagePtr m_stage;
+    UsdTimeCode m_time_code;
+    // Notices can be sent from the thread editing the stage.
+    mutable std::mutex m_networks_mutex;
+    std::unordered_map<SdfPath, compiled_network, SdfPath::Hash> m_networks;
+    std::unordered_map<SdfPath, AtNode*, SdfPath::Hash> m_nodes;
+    TfNotice::Key m_objects_changed_key;
+    import_stats m_stats;
+};
+
+PXR_NAMESPACE_CLOSE_SCOPE
+
+#endif
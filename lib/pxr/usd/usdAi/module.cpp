@@ -12,6 +12,7 @@ TF_WRAP_MODULE
     TF_WRAP(UsdAiProcedural);
     TF_WRAP(UsdAiShader);
     TF_WRAP(UsdAiShaderExport);
+    TF_WRAP(UsdAiShaderImport);
     TF_WRAP(UsdAiShapeAPI);
     TF_WRAP(UsdAiVolume);
 }
@@ -27,12 +27,18 @@
 
 #include "pxr/usd/usd/pyConversions.h"
 #include "pxr/base/tf/pyContainerConversions.h"
+#include "pxr/base/tf/pyLock.h"
 #include "pxr/base/tf/pyResultConversions.h"
 #include "pxr/base/tf/pyUtils.h"
 #include "pxr/base/tf/wrapTypeHelpers.h"
 
 #include <boost/python/class.hpp>
+#include <boost/python/enum.hpp>
 #include <boost/python/import.hpp>
+#include <boost/python/list.hpp>
+#include <boost/python/scope.hpp>
+#include <boost/python/stl_iterator.hpp>
+#include <boost/python/tuple.hpp>
 
 #include <string>
 
@@ -45,13 +51,27 @@ PXR_NAMESPACE_USING_DIRECTIVE
 namespace {
 
 // TODO: register a converter for AtNode* type?
+// Accepts ctypes nodes, or their addresses as ints.
 AtNode* to_arnold_node(const object& ctypes_node) {
     static object ctypes_addressof = import("ctypes").attr("addressof");
     if (ctypes_node.is_none()) {
         return nullptr;
-    } else {
-        return *reinterpret_cast<AtNode**>(uintptr_t(extract<uintptr_t>(ctypes_addressof(ctypes_node))));
     }
+    extract<uintptr_t> address(ctypes_node);
+    if (address.check()) {
+        return reinterpret_cast<AtNode*>(address());
+    }
+    return *reinterpret_cast<AtNode**>(uintptr_t(extract<uintptr_t>(ctypes_addressof(ctypes_node))));
+}
+
+static list
+to_list(const std::vector<SdfPath>& paths)
+{
+    list result;
+    for (const auto& path : paths) {
+        result.append(path);
+    }
+    return result;
 }
 
 static SdfPath
@@ -61,6 +81,79 @@ export_material(AiShaderExport &self, const char* material_name,
     return self.export_material(material_name, to_arnold_node(surf_shader), to_arnold_node(disp_shader));
 }
 
+static SdfPath
+get_node_path(const AiShaderExport &self, const object& arnold_node)
+{
+    return self.get_node_path(to_arnold_node(arnold_node));
+}
+
+// Everything is converted first, the GIL is released for the whole export.
+static list
+export_materials(AiShaderExport &self, const object& materials)
+{
+    std::vector<AiShaderExport::material_desc> cpp_materials;
+    const auto count = len(materials);
+    cpp_materials.reserve(count);
+    for (auto i = decltype(count){0}; i < count; ++i) {
+        const object material = materials[i];
+        cpp_materials.push_back(AiShaderExport::material_desc {
+            extract<std::string>(material[0])(), to_arnold_node(material[1]),
+            len(material) > 2 ? to_arnold_node(material[2]) : nullptr});
+    }
+    std::vector<SdfPath> material_paths;
+    {
+        TF_PY_ALLOW_THREADS_IN_SCOPE();
+        material_paths = self.export_materials(cpp_materials);
+    }
+    return to_list(material_paths);
+}
+
+static list
+export_arnold_nodes(AiShaderExport &self, const object& arnold_nodes, const SdfPath& parent_path,
+                    const object& exportable_params)
+{
+    std::vector<const AtNode*> cpp_nodes;
+    const auto count = len(arnold_nodes);
+    cpp_nodes.reserve(count);
+    for (auto i = decltype(count){0}; i < count; ++i) {
+        cpp_nodes.push_back(to_arnold_node(arnold_nodes[i]));
+    }
+    std::set<std::string> cpp_params;
+    if (!exportable_params.is_none()) {
+        cpp_params.insert(stl_input_iterator<std::string>(exportable_params), stl_input_iterator<std::string>());
+    }
+    std::vector<SdfPath> shader_paths;
+    {
+        TF_PY_ALLOW_THREADS_IN_SCOPE();
+        shader_paths = self.export_arnold_nodes(cpp_nodes, parent_path,
+                                                exportable_params.is_none() ? nullptr : &cpp_params);
+    }
+    return to_list(shader_paths);
+}
+
+static void
+bind_materials(AiShaderExport &self, const object& bindings, bool group)
+{
+    std::vector<std::pair<SdfPath, SdfPath>> cpp_bindings;
+    const auto count = len(bindings);
+    cpp_bindings.reserve(count);
+    for (auto i = decltype(count){0}; i < count; ++i) {
+        const object binding = bindings[i];
+        cpp_bindings.push_back(std::make_pair(extract<SdfPath>(binding[0])(), extract<SdfPath>(binding[1])()));
+    }
+    self.bind_materials(cpp_bindings, group);
+}
+
+static list
+get_renamed(const AiShaderExport &self)
+{
+    list renamed;
+    for (const auto& each : self.get_renamed()) {
+        renamed.append(make_tuple(each.first, each.second));
+    }
+    return renamed;
+}
+
 static SdfPath
 export_arnold_node(AiShaderExport &self, const object& arnold_node,
                     SdfPath& parent_path, const std::set<std::string>& exportable_params)
@@ -94,9 +187,40 @@ void wrapUsdAiShaderExport()
 {
     typedef AiShaderExport This;
 
-    class_<This>
+    class_<This, boost::noncopyable>
         cls("AiShaderExport", no_init);
 
+    {
+        scope s = cls;
+        enum_<This::AuthoringMode>("AuthoringMode")
+            .value("Stage", This::AUTHORING_MODE_STAGE)
+            .value("Layer", This::AUTHORING_MODE_LAYER)
+            ;
+
+        class_<This::export_stats>("ExportStats")
+            .def_readonly("gather_time", &This::export_stats::gather_time)
+            .def_readonly("merge_time", &This::export_stats::merge_time)
+            .def_readonly("author_time", &This::export_stats::author_time)
+            .def_readonly("bind_time", &This::export_stats::bind_time)
+            .def_readonly("collapse_time", &This::export_stats::collapse_time)
+            .def_readonly("nodes_gathered", &This::export_stats::nodes_gathered)
+            .def_readonly("nodes_deduplicated", &This::export_stats::nodes_deduplicated)
+            .def_readonly("inputs_authored", &This::export_stats::inputs_authored)
+            .def_readonly("inputs_elided", &This::export_stats::inputs_elided)
+            .def_readonly("connections_authored", &This::export_stats::connections_authored)
+            .def_readonly("arrays_copied", &This::export_stats::arrays_copied)
+            .def_readonly("array_bytes_copied", &This::export_stats::array_bytes_copied)
+            .def_readonly("bindings_authored", &This::export_stats::bindings_authored)
+            .def_readonly("bindings_collapsed", &This::export_stats::bindings_collapsed)
+            .def_readonly("bindings_removed", &This::export_stats::bindings_removed)
+            .def_readonly("entry_cache_hits", &This::export_stats::entry_cache_hits)
+            .def_readonly("entry_cache_misses", &This::export_stats::entry_cache_misses)
+            .def_readonly("inputs_sampled", &This::export_stats::inputs_sampled)
+            .def_readonly("materials_unchanged", &This::export_stats::materials_unchanged)
+            .def_readonly("prims_orphaned", &This::export_stats::prims_orphaned)
+            ;
+    }
+
     cls
         .def(init<const UsdStagePtr &, const SdfPath &, const UsdTimeCode &>(
              (arg("_stage"),
@@ -109,16 +233,25 @@ void wrapUsdAiShaderExport()
         .def("bind_material", &This::bind_material,
              (arg("shader_path"),
               arg("shape_path"))) 
+        .def("bind_materials", &bind_materials,
+             (arg("bindings"),
+              arg("group") = false))
         .def("export_material", &export_material,
              (arg("material_name"),
               arg("surf_shader"),
               arg("disp_shader")))
+        .def("export_materials", &export_materials,
+             (arg("materials")))
         // TODO: add an overload of export_arnold_node w/out exportable_params
         .def("export_arnold_node", &export_arnold_node,
              (arg("material_name"),
               arg("arnold_node"),
               arg("parent_path"),
               arg("exportable_params")))
+        .def("export_arnold_nodes", &export_arnold_nodes,
+             (arg("arnold_nodes"),
+              arg("parent_path"),
+              arg("exportable_params") = object()))
         // .def("get_output", &get_output,
         //      (arg("src_arnold_node"),
         //       arg("src_shader"),
@@ -131,5 +264,33 @@ void wrapUsdAiShaderExport()
               arg("src_arnold_node"),
               arg("src_shader"),
               arg("src_comp_index") = -1))
+        .def("set_authoring_mode", &This::set_authoring_mode,
+             (arg("mode")))
+        .def("get_authoring_mode", &This::get_authoring_mode)
+        .def("set_deduplicate_nodes", &This::set_deduplicate_nodes,
+             (arg("deduplicate")))
+        .def("get_deduplicate_nodes", &This::get_deduplicate_nodes)
+        .def("set_shared_scope", &This::set_shared_scope,
+             (arg("scope_name")))
+        .def("get_shared_scope", &This::get_shared_scope)
+        .def("set_sparse", &This::set_sparse,
+             (arg("sparse")))
+        .def("get_sparse", &This::get_sparse)
+        .def("set_incremental", &This::set_incremental,
+             (arg("incremental")))
+        .def("get_incremental", &This::get_incremental)
+        .def("remove_orphaned", &This::remove_orphaned)
+        .def("set_time_code", &This::set_time_code,
+             (arg("time_code")))
+        .def("get_time_code", &This::get_time_code)
+        .def("begin_time_samples", &This::begin_time_samples)
+        .def("end_time_samples", &This::end_time_samples)
+        .def("begin_concurrent_export", &This::begin_concurrent_export)
+        .def("end_concurrent_export", &This::end_concurrent_export)
+        .def("get_node_path", &get_node_path,
+             (arg("arnold_node")))
+        .def("get_renamed", &get_renamed)
+        .def("get_stats", &This::get_stats)
+        .def("reset_stats", &This::reset_stats)
         ;
 }
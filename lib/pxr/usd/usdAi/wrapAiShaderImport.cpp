@@ -0,0 +1,114 @@
+//
+// Copyright 2016 Pixar
+//
+// Licensed under the Apache License, Version 2.0 (the "Apache License")
+// with the following modification; you may not use this file except in
+// compliance with the Apache License and the following modification to it:
+// Section 6. Trademarks. is deleted and replaced with:
+//
+// 6. Trademarks. This License does not grant permission to use the trade
+//    names, trademarks, service marks, or product names of the Licensor
+//    and its affiliates, except as required to comply with Section 4(c) of
+//    the License and to reproduce the content of the NOTICE file.
+//
+// You may obtain a copy of the Apache License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the Apache License with the above modification is
+// distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied. See the Apache License for the specific
+// language governing permissions and limitations under the Apache License.
+//
+#include "pxr/usd/usdAi/aiShaderImport.h"
+
+#include "pxr/usd/usd/pyConversions.h"
+#include "pxr/base/tf/pyContainerConversions.h"
+#include "pxr/base/tf/pyResultConversions.h"
+#include "pxr/base/tf/pyUtils.h"
+#include "pxr/base/tf/wrapTypeHelpers.h"
+
+#include <boost/python/class.hpp>
+#include <boost/python/list.hpp>
+#include <boost/python/scope.hpp>
+#include <boost/python/tuple.hpp>
+
+using namespace boost::python;
+
+PXR_NAMESPACE_USING_DIRECTIVE
+
+namespace {
+
+// Nodes are returned as addresses, ctypes.cast them to POINTER(AtNode).
+object from_arnold_node(AtNode* arnold_node) {
+    return arnold_node == nullptr ? object() : object(reinterpret_cast<uintptr_t>(arnold_node));
+}
+
+tuple to_tuple(const AiShaderImport::imported_material& material) {
+    return make_tuple(material.path, from_arnold_node(material.surface), from_arnold_node(material.displacement));
+}
+
+static tuple
+import_material(AiShaderImport &self, const SdfPath& material_path)
+{
+    return to_tuple(self.import_material(material_path));
+}
+
+static list
+import_materials(AiShaderImport &self, const SdfPathVector& material_paths)
+{
+    list imported;
+    for (const auto& each : self.import_materials(material_paths)) {
+        imported.append(to_tuple(each));
+    }
+    return imported;
+}
+
+static object
+get_arnold_node(const AiShaderImport &self, const SdfPath& shader_path)
+{
+    return from_arnold_node(self.get_arnold_node(shader_path));
+}
+
+} // anonymous namespace 
+
+void wrapUsdAiShaderImport()
+{
+    typedef AiShaderImport This;
+
+    class_<This, boost::noncopyable>
+        cls("AiShaderImport", no_init);
+
+    {
+        scope s = cls;
+        class_<This::import_stats>("ImportStats")
+            .def_readonly("read_time", &This::import_stats::read_time)
+            .def_readonly("create_time", &This::import_stats::create_time)
+            .def_readonly("cache_hits", &This::import_stats::cache_hits)
+            .def_readonly("cache_misses", &This::import_stats::cache_misses)
+            .def_readonly("nodes_created", &This::import_stats::nodes_created)
+            .def_readonly("nodes_updated", &This::import_stats::nodes_updated)
+            .def_readonly("inputs_set", &This::import_stats::inputs_set)
+            .def_readonly("connections_set", &This::import_stats::connections_set)
+            ;
+    }
+
+    cls
+        .def(init<const UsdStagePtr &, const UsdTimeCode &>(
+             (arg("_stage"),
+              arg("_time_code") = UsdTimeCode::Default())))
+        .def("import_material", &import_material,
+             (arg("material_path")))
+        .def("import_materials", &import_materials,
+             (arg("material_paths")))
+        .def("get_arnold_node", &get_arnold_node,
+             (arg("shader_path")))
+        .def("set_time_code", &This::set_time_code,
+             (arg("time_code")))
+        .def("get_time_code", &This::get_time_code)
+        .def("clear_cache", &This::clear_cache)
+        .def("get_stats", &This::get_stats)
+        .def("reset_stats", &This::reset_stats)
+        ;
+}
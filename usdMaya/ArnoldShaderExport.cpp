@@ -1,8 +1,6 @@
 #include "ArnoldShaderExport.h"
 
 #include "pxr/base/tf/getenv.h"
-#include "pxr/usd/usdShade/material.h"
-#include "pxr/usd/usdAi/aiMaterialAPI.h"
 
 #include <maya/MFnDependencyNode.h>
 #include <maya/MPlug.h>
@@ -42,6 +40,13 @@ ArnoldShaderExport::ArnoldShaderExport(const UsdStageRefPtr& _stage,
     } else {
         m_transform_assignment = TRANSFORM_ASSIGNMENT_DISABLE;
     }
+    if (TfGetenv("PXR_MAYA_ARNOLD_AUTHORING_MODE", "stage") == "layer") {
+        set_authoring_mode(AUTHORING_MODE_LAYER);
+    }
+    set_deduplicate_nodes(TfGetenvBool("PXR_MAYA_ARNOLD_DEDUPLICATE_SHADERS", false));
+    set_shared_scope(TfGetenv("PXR_MAYA_ARNOLD_SHARED_SCOPE", ""));
+    set_sparse(TfGetenvBool("PXR_MAYA_ARNOLD_SPARSE_AUTHORING", false));
+    set_incremental(TfGetenvBool("PXR_MAYA_ARNOLD_INCREMENTAL_EXPORT", false));
     CMayaScene::End();
     AiMsgSetConsoleFlags(AI_LOG_NONE);
     CMayaScene::Begin(MTOA_SESSION_ASS);
@@ -75,7 +80,8 @@ ArnoldShaderExport::export_shading_engine(MObject obj) {
 }
 
 void
-ArnoldShaderExport::setup_shader(const MDagPath& dg, const SdfPath& path) {
+ArnoldShaderExport::setup_shader(const MDagPath& dg, const SdfPath& path,
+                                 std::vector<std::pair<SdfPath, SdfPath>>& bindings) {
     auto obj = dg.node();
     if (obj.hasFn(MFn::kTransform) || obj.hasFn(MFn::kLocator)) { return; }
 
@@ -87,40 +93,17 @@ ArnoldShaderExport::setup_shader(const MDagPath& dg, const SdfPath& path) {
             if (!AiNodeIs(volume_node, volumeString)) {
                 return;
             }
-            const auto* linked_shader = reinterpret_cast<const AtNode*>(AiNodeGetPtr(volume_node, "shader"));
+            auto* linked_shader = reinterpret_cast<AtNode*>(AiNodeGetPtr(volume_node, "shader"));
             if (linked_shader == nullptr) {
                 return;
             }
-            std::string cleaned_volume_name = AiNodeGetName(linked_shader);
-            clean_arnold_name(cleaned_volume_name);
-
-            // start: below here is roughly the same as AiShaderExport::export_material
-            auto material_path = m_shaders_scope.AppendChild(TfToken(cleaned_volume_name));
-
-            UsdAiMaterialAPI material;
-            auto material_prim = m_stage->GetPrimAtPath(material_path);
-            if (!material_prim.IsValid()) {
-                material = UsdAiMaterialAPI(UsdShadeMaterial::Define(m_stage, material_path));
-                material_prim = material.GetPrim();
-            }
-            else {
-                // FIXME: why would a material already exist for a vdb_visualizer?
-                material = UsdAiMaterialAPI(material_prim);
-            }
-
-            auto linked_path = export_arnold_node(linked_shader, material_path);
-            if (!linked_path.IsEmpty()) {
-                auto rel = material.GetSurfaceRel();
-                if (rel) {
-                    rel.ClearTargets(true);
-                    rel.AddTarget(linked_path);
-                } else {
-                    rel = material.CreateSurfaceRel();
-                    rel.AddTarget(linked_path);
-                }
+            // Going through export_material keeps the volume material known
+            // to incremental exports, so remove_orphaned leaves it alone.
+            const auto material_path = export_material(AiNodeGetName(linked_shader), linked_shader);
+            if (material_path.IsEmpty()) {
+                return;
             }
-            // end
-            bind_material(material_path, path);
+            bindings.push_back(std::make_pair(material_path, path));
             return;
         }
     }
@@ -163,7 +146,7 @@ ArnoldShaderExport::setup_shader(const MDagPath& dg, const SdfPath& path) {
                     if (shader_path.IsEmpty()) {
                         return;
                     }
-                    bind_material(shader_path, it->second.GetPrimPath());
+                    bindings.push_back(std::make_pair(shader_path, it->second.GetPrimPath()));
                     return;
                 }
             }
@@ -178,17 +161,19 @@ ArnoldShaderExport::setup_shader(const MDagPath& dg, const SdfPath& path) {
     if (shader_path.IsEmpty()) {
         return;
     }
-    bind_material(shader_path, path);
+    bindings.push_back(std::make_pair(shader_path, path));
 }
 
 
 void ArnoldShaderExport::setup_shaders() {
+    std::vector<std::pair<SdfPath, SdfPath>> bindings;
     for (const auto& it : m_dag_to_usd) {
-        setup_shader(it.first, it.second);
+        setup_shader(it.first, it.second, bindings);
     }
-    if (m_transform_assignment == TRANSFORM_ASSIGNMENT_COMMON) {
-        collapse_shaders();
+    if (get_incremental()) {
+        remove_orphaned();
     }
+    bind_materials(bindings, m_transform_assignment == TRANSFORM_ASSIGNMENT_COMMON);
 }
 
 PXR_NAMESPACE_CLOSE_SCOPE
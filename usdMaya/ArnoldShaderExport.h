@@ -27,7 +27,7 @@ private:
     TransformAssignment m_transform_assignment;
     const PxrUsdMayaUtil::MDagPathMap<SdfPath>::Type& m_dag_to_usd;
 
-    void setup_shader(const MDagPath& dg, const SdfPath& path);
+    void setup_shader(const MDagPath& dg, const SdfPath& path, std::vector<std::pair<SdfPath, SdfPath>>& bindings);
 public:
     SdfPath export_shading_engine(MObject obj);
     void setup_shaders();